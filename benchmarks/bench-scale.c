@@ -0,0 +1,236 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "dlfcn.h"
+#include "report.h"
+
+/* Fixture dlls fixture_<exports>_<index>.dll are generated by
+ * CMakeLists.txt for each number of exports in BENCH_SCALE_EXPORTS. Half of
+ * the exports of every fixture are named scale_shared_<number> and are
+ * exported by all fixtures, the rest is named scale_<index>_<number>.
+ */
+#ifndef BENCH_SCALE_DLLS
+#define BENCH_SCALE_DLLS 128
+#endif
+#ifndef BENCH_SCALE_EXPORTS
+#define BENCH_SCALE_EXPORTS 16, 1024
+#endif
+
+/* Number of names resolved by one dlsym_many() call */
+#define BENCH_BATCH 64
+
+static void format_fixture_path( char *buffer, unsigned long exports, unsigned long index )
+{
+    sprintf( buffer, "fixture_%lu_%lu.dll", exports, index );
+}
+
+/* Name of an export which only the fixture with the given index has */
+static void format_unique_name( char *buffer, unsigned long exports, unsigned long index, unsigned long number )
+{
+    sprintf( buffer, "scale_%lu_%05lu", index, exports / 2 + number % ( exports - exports / 2 ) );
+}
+
+/* Time the public functions with the first dlls fixtures loaded */
+static int bench_step( void **handles, unsigned long dlls, unsigned long exports, unsigned long iterations )
+{
+    static char names[BENCH_BATCH][48];
+    const char *pnames[BENCH_BATCH];
+    void *symbols[BENCH_BATCH];
+    char name[64];
+    char path[MAX_PATH];
+    void *last, *library, *symbol;
+    unsigned long last_global, i;
+    LARGE_INTEGER start, end;
+    Dl_info info;
+
+    /* Even fixtures are opened with RTLD_GLOBAL, odd with RTLD_LOCAL */
+    last = handles[dlls - 1];
+    last_global = ( dlls - 1 ) & ~1UL;
+
+    format_unique_name( name, exports, dlls - 1, 0 );
+    symbol = dlsym( last, name );
+    if( !symbol )
+    {
+        fprintf( stderr, "ERROR\tCould not get symbol %s: %s\n", name, dlerror( ) );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( last, name );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym handle hit", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( last, "scale_missing" );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym handle miss", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_DEFAULT, "scale_shared_00000" );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym default hit (shared name)", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    format_unique_name( name, exports, last_global, 0 );
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_DEFAULT, name );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym default hit (last global dll)", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_DEFAULT, "scale_missing" );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym default miss (same name)", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    /* Unique names, so every lookup walks all modules */
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+    {
+        sprintf( name, "scale_missing_%lu_%lu_%lu", dlls, exports, i );
+        dlsym( RTLD_DEFAULT, name );
+    }
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym default miss (unique names)", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    for( i = 0; i < BENCH_BATCH; i++ )
+    {
+        format_unique_name( names[i], exports, dlls - 1, i * 7919 );
+        pnames[i] = names[i];
+    }
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations / BENCH_BATCH + 1; i++ )
+        dlsym_many( last, pnames, symbols, BENCH_BATCH );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym_many handle", dlls, exports, ( iterations / BENCH_BATCH + 1 ) * BENCH_BATCH, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dladdr( symbol, &info );
+    QueryPerformanceCounter( &end );
+    report_scaled( "dladdr", dlls, exports, iterations, elapsed_ns( start, end ) );
+
+    format_fixture_path( path, exports, dlls - 1 );
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations / 10 + 1; i++ )
+    {
+        library = dlopen( path, RTLD_LOCAL );
+        if( !library )
+        {
+            fprintf( stderr, "ERROR\tCould not open %s: %s\n", path, dlerror( ) );
+            return 1;
+        }
+        dlclose( library );
+    }
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlopen+dlclose (already opened)", dlls, exports, iterations / 10 + 1, elapsed_ns( start, end ) );
+
+    /* Module loaded by the loader but not by dlopen() misses the path cache,
+     * so this times LoadLibraryEx( ) and the check whether it loaded the
+     * module, which must not depend on the number of loaded modules */
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations / 10 + 1; i++ )
+    {
+        library = dlopen( "kernel32.dll", RTLD_LOCAL );
+        if( !library )
+        {
+            fprintf( stderr, "ERROR\tCould not open kernel32.dll: %s\n", dlerror( ) );
+            return 1;
+        }
+        dlclose( library );
+    }
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlopen+dlclose (loaded by the loader)", dlls, exports, iterations / 10 + 1, elapsed_ns( start, end ) );
+
+    return 0;
+}
+
+/* Load fixtures with the given number of exports one by one and time the
+ * public functions whenever the number of loaded fixtures doubles */
+static int bench_scale( unsigned long exports, unsigned long iterations )
+{
+    static void *handles[BENCH_SCALE_DLLS];
+    char path[MAX_PATH];
+    LARGE_INTEGER start, end;
+    unsigned long opened, previous, step;
+    int ret = 0;
+
+    opened = 0;
+    for( step = 1; !ret; step = step * 2 < BENCH_SCALE_DLLS ? step * 2 : BENCH_SCALE_DLLS )
+    {
+        previous = opened;
+        QueryPerformanceCounter( &start );
+        for( ; opened < step; opened++ )
+        {
+            format_fixture_path( path, exports, opened );
+            handles[opened] = dlopen( path, ( opened & 1 ) ? RTLD_LOCAL : RTLD_GLOBAL );
+            if( !handles[opened] )
+            {
+                fprintf( stderr, "ERROR\tCould not open %s: %s\n", path, dlerror( ) );
+                ret = 1;
+                break;
+            }
+        }
+        QueryPerformanceCounter( &end );
+
+        if( ret )
+            break;
+
+        report_scaled( "dlopen (not loaded)", opened, exports, opened - previous, elapsed_ns( start, end ) );
+
+        ret = bench_step( handles, opened, exports, iterations );
+
+        if( step == BENCH_SCALE_DLLS )
+            break;
+    }
+
+    while( opened > 0 )
+        dlclose( handles[--opened] );
+
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    static const unsigned long exports[] = { BENCH_SCALE_EXPORTS };
+    unsigned long iterations = 1000;
+    size_t i;
+    int ret = 0;
+
+    if( !report_init( argc, argv, &iterations ) )
+        return 1;
+
+    for( i = 0; i < sizeof( exports ) / sizeof( exports[0] ); i++ )
+        ret |= bench_scale( exports[i], iterations );
+
+    report_finish( );
+
+    return ret;
+}
@@ -0,0 +1,204 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "dlfcn.h"
+#include "report.h"
+
+/* Copies the fixture dlls of bench-scale (see bench-scale.c) round robin to
+ * BENCH_SCAN_FILES files in directory scan-fixtures and times finding the
+ * files which export two names: with dlsym_scan( ) and different numbers of
+ * threads, with dlsym_peek( ) on each file, and with dlopen( ) and dlsym( ).
+ * Both names are exported only by fixtures with more than 200 exports.
+ * Results are per file, the iterations argument is the number of scans.
+ */
+#ifndef BENCH_SCALE_DLLS
+#define BENCH_SCALE_DLLS 128
+#endif
+#ifndef BENCH_SCALE_EXPORTS
+#define BENCH_SCALE_EXPORTS 16, 1024
+#endif
+#ifndef BENCH_SCAN_FILES
+#define BENCH_SCAN_FILES 1000
+#endif
+
+#define BENCH_SCAN_DIR "scan-fixtures"
+
+static const unsigned long exports[] = { BENCH_SCALE_EXPORTS };
+static const char *names[] = { "scale_shared_00000", "scale_shared_00100" };
+
+static void format_scan_path( char *buffer, unsigned long index )
+{
+    sprintf( buffer, BENCH_SCAN_DIR "\\scan_%04lu.dll", index );
+}
+
+/* Copy fixtures and return number of copies which export both names */
+static long create_fixtures( void )
+{
+    char source[MAX_PATH];
+    char path[MAX_PATH];
+    unsigned long i, count;
+    long matching;
+
+    if( !CreateDirectoryA( BENCH_SCAN_DIR, NULL ) && GetLastError( ) != ERROR_ALREADY_EXISTS )
+    {
+        fprintf( stderr, "ERROR\tCould not create directory " BENCH_SCAN_DIR ": %lu\n", (unsigned long) GetLastError( ) );
+        return -1;
+    }
+
+    matching = 0;
+    for( i = 0; i < BENCH_SCAN_FILES; i++ )
+    {
+        count = exports[i % ( sizeof( exports ) / sizeof( exports[0] ) )];
+        sprintf( source, "fixture_%lu_%lu.dll", count, ( i / ( sizeof( exports ) / sizeof( exports[0] ) ) ) % BENCH_SCALE_DLLS );
+        format_scan_path( path, i );
+        if( !CopyFileA( source, path, FALSE ) )
+        {
+            fprintf( stderr, "ERROR\tCould not copy %s to %s: %lu\n", source, path, (unsigned long) GetLastError( ) );
+            return -1;
+        }
+        if( count / 2 > 100 )
+            matching++;
+    }
+
+    return matching;
+}
+
+static void remove_fixtures( void )
+{
+    char path[MAX_PATH];
+    unsigned long i;
+
+    for( i = 0; i < BENCH_SCAN_FILES; i++ )
+    {
+        format_scan_path( path, i );
+        DeleteFileA( path );
+    }
+    RemoveDirectoryA( BENCH_SCAN_DIR );
+}
+
+static int bench_scan( long matching, unsigned long scans )
+{
+    dlsym_scan_result *results;
+    SYSTEM_INFO info;
+    LARGE_INTEGER start, end;
+    char path[MAX_PATH];
+    char label[64];
+    int found[2];
+    void *handle;
+    unsigned long i, j;
+    long matched;
+    int threads, processors, ret;
+
+    GetSystemInfo( &info );
+    processors = (int) info.dwNumberOfProcessors;
+
+    /* Powers of two up to the number of processors, and that number */
+    threads = 1;
+    for( ;; )
+    {
+        QueryPerformanceCounter( &start );
+        for( i = 0; i < scans; i++ )
+        {
+            ret = dlsym_scan( BENCH_SCAN_DIR, names, 2, threads, &results );
+            dlsym_scan_free( results, ret );
+            if( ret != matching )
+            {
+                fprintf( stderr, "ERROR\tdlsym_scan( ) found %d files instead of %ld: %s\n", ret, matching, ret < 0 ? dlerror( ) : "" );
+                return 1;
+            }
+        }
+        QueryPerformanceCounter( &end );
+        sprintf( label, "dlsym_scan (%d threads)", threads );
+        report_scaled( label, BENCH_SCAN_FILES, 0, scans * BENCH_SCAN_FILES, elapsed_ns( start, end ) );
+
+        if( threads >= processors )
+            break;
+        threads *= 2;
+        if( threads > processors )
+            threads = processors;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < scans; i++ )
+    {
+        matched = 0;
+        for( j = 0; j < BENCH_SCAN_FILES; j++ )
+        {
+            format_scan_path( path, j );
+            if( dlsym_peek( path, names, found, 2 ) == 2 )
+                matched++;
+        }
+        if( matched != matching )
+        {
+            fprintf( stderr, "ERROR\tdlsym_peek( ) found %ld files instead of %ld\n", matched, matching );
+            return 1;
+        }
+    }
+    QueryPerformanceCounter( &end );
+    report_scaled( "dlsym_peek", BENCH_SCAN_FILES, 0, scans * BENCH_SCAN_FILES, elapsed_ns( start, end ) );
+
+    /* Loading is slow, so it is done only once */
+    QueryPerformanceCounter( &start );
+    matched = 0;
+    for( j = 0; j < BENCH_SCAN_FILES; j++ )
+    {
+        format_scan_path( path, j );
+        handle = dlopen( path, RTLD_LOCAL );
+        if( handle == NULL )
+            continue;
+        if( dlsym( handle, names[0] ) != NULL && dlsym( handle, names[1] ) != NULL )
+            matched++;
+        dlclose( handle );
+    }
+    QueryPerformanceCounter( &end );
+    if( matched != matching )
+    {
+        fprintf( stderr, "ERROR\tdlopen( ) and dlsym( ) found %ld files instead of %ld\n", matched, matching );
+        return 1;
+    }
+    report_scaled( "dlopen+dlsym+dlclose", BENCH_SCAN_FILES, 0, BENCH_SCAN_FILES, elapsed_ns( start, end ) );
+
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    unsigned long scans = 10;
+    long matching;
+    int ret;
+
+    if( !report_init( argc, argv, &scans ) )
+        return 1;
+
+    matching = create_fixtures( );
+    ret = matching < 0 || bench_scan( matching, scans );
+    remove_fixtures( );
+
+    report_finish( );
+
+    return ret;
+}
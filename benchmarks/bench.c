@@ -0,0 +1,479 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "dlfcn.h"
+#include "report.h"
+
+/* Number of exports of benchdll_large.dll, see gen-exports.cmake */
+#ifndef BENCH_LARGE_EXPORTS
+#define BENCH_LARGE_EXPORTS 50000
+#endif
+
+/* Number of different addresses used in one benchmark loop */
+#define BENCH_ADDRESSES 64
+
+/* Number of names resolved by one dlsym_many() call */
+#define BENCH_BATCH 256
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6))
+/* hide warning "reclared without 'dllimport' attribute" */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wattributes"
+#elif defined(_MSC_VER)
+/* disable warning C4273 inconsistent dll linkage */
+#pragma warning(push)
+#pragma warning(disable: 4273)
+#endif
+/* Declared without dllimport, so its address is an import thunk, see
+ * tests/test-dladdr.c */
+HMODULE WINAPI GetModuleHandleA (LPCSTR lpModuleName);
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6))
+#pragma GCC diagnostic pop
+#elif defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+/* Not exported by the executable */
+static int bench_local_function( void )
+{
+    return 1;
+}
+
+static void format_export_name( char *buffer, unsigned long index )
+{
+    sprintf( buffer, "bench_export_%05lu", index );
+}
+
+/* dladdr() on functions spread over a dll with many exports */
+static int bench_dladdr_large( unsigned long iterations )
+{
+    void *library;
+    void *addrs[BENCH_ADDRESSES];
+    Dl_info infos[BENCH_ADDRESSES];
+    char name[32];
+    Dl_info info;
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    library = dlopen( "benchdll_large.dll", RTLD_LOCAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_large.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    for( i = 0; i < BENCH_ADDRESSES; i++ )
+    {
+        format_export_name( name, i * ( BENCH_LARGE_EXPORTS - 1 ) / ( BENCH_ADDRESSES - 1 ) );
+        addrs[i] = dlsym( library, name );
+        if( !addrs[i] )
+        {
+            fprintf( stderr, "ERROR\tCould not get symbol %s: %s\n", name, dlerror( ) );
+            dlclose( library );
+            return 1;
+        }
+    }
+
+    /* The first call builds the per-module export index */
+    QueryPerformanceCounter( &start );
+    if( !dladdr( (char *) addrs[BENCH_ADDRESSES-1] + 1, &info ) )
+    {
+        fprintf( stderr, "ERROR\tdladdr failed for %p\n", addrs[BENCH_ADDRESSES-1] );
+        dlclose( library );
+        return 1;
+    }
+    QueryPerformanceCounter( &end );
+    report( "dladdr large dll (first call)", 1, elapsed_ns( start, end ) );
+
+    format_export_name( name, BENCH_LARGE_EXPORTS - 1 );
+    if( !info.dli_sname || strcmp( info.dli_sname, name ) != 0 )
+    {
+        fprintf( stderr, "ERROR\tdladdr returned symbol %s, expected %s\n", info.dli_sname ? info.dli_sname : "(null)", name );
+        dlclose( library );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dladdr( (char *) addrs[i % BENCH_ADDRESSES] + 1, &info );
+    QueryPerformanceCounter( &end );
+    report( "dladdr large dll", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations / BENCH_ADDRESSES + 1; i++ )
+        dladdr_batch( (const void *const *) addrs, infos, BENCH_ADDRESSES );
+    QueryPerformanceCounter( &end );
+    report( "dladdr_batch large dll", ( iterations / BENCH_ADDRESSES + 1 ) * BENCH_ADDRESSES, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dlsym() of every export of a dll with many exports through its handle */
+static int bench_dlsym_large( unsigned long iterations )
+{
+    void *library;
+    char name[32];
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    library = dlopen( "benchdll_large.dll", RTLD_LOCAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_large.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    /* The first pass builds the per-module export name index */
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < BENCH_LARGE_EXPORTS; i++ )
+    {
+        format_export_name( name, i );
+        if( !dlsym( library, name ) )
+        {
+            fprintf( stderr, "ERROR\tCould not get symbol %s: %s\n", name, dlerror( ) );
+            dlclose( library );
+            return 1;
+        }
+    }
+    QueryPerformanceCounter( &end );
+    report( "dlsym large dll (all exports, first pass)", BENCH_LARGE_EXPORTS, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+    {
+        format_export_name( name, ( i * 7919 ) % BENCH_LARGE_EXPORTS );
+        dlsym( library, name );
+    }
+    QueryPerformanceCounter( &end );
+    report( "dlsym large dll", iterations, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dlsym_many() of vtable sized batches compared to one dlsym() per name */
+static int bench_dlsym_many_large( unsigned long iterations )
+{
+    void *library;
+    static char names[BENCH_BATCH][32];
+    const char *pnames[BENCH_BATCH];
+    void *symbols[BENCH_BATCH];
+    LARGE_INTEGER start, end;
+    unsigned long i, j;
+
+    library = dlopen( "benchdll_large.dll", RTLD_LOCAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_large.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    for( j = 0; j < BENCH_BATCH; j++ )
+    {
+        format_export_name( names[j], ( j * 7919 ) % BENCH_LARGE_EXPORTS );
+        pnames[j] = names[j];
+    }
+
+    if( dlsym_many( library, pnames, symbols, BENCH_BATCH ) != 0 )
+    {
+        fprintf( stderr, "ERROR\tdlsym_many failed: %s\n", dlerror( ) );
+        dlclose( library );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        for( j = 0; j < BENCH_BATCH; j++ )
+            symbols[j] = dlsym( library, pnames[j] );
+    QueryPerformanceCounter( &end );
+    report( "dlsym large dll (batch of names)", iterations * BENCH_BATCH, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym_many( library, pnames, symbols, BENCH_BATCH );
+    QueryPerformanceCounter( &end );
+    report( "dlsym_many large dll", iterations * BENCH_BATCH, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dlsym() misses in the global scope while many modules are loaded with
+ * RTLD_LOCAL. Copies of benchdll_small.dll under different names are used
+ * as local objects. */
+static int bench_dlsym_local_objects( unsigned long iterations )
+{
+    static const unsigned long counts[] = { 1, 16, 64, 256 };
+    void *handles[256];
+    char path[MAX_PATH];
+    char name[64];
+    LARGE_INTEGER start, end;
+    unsigned long opened, c, i;
+    int ret = 0;
+
+    opened = 0;
+    for( c = 0; c < sizeof( counts ) / sizeof( counts[0] ) && !ret; c++ )
+    {
+        for( ; opened < counts[c]; opened++ )
+        {
+            sprintf( path, "bench_local_%03lu.dll", opened );
+            if( !CopyFileA( "benchdll_small.dll", path, FALSE ) )
+            {
+                fprintf( stderr, "ERROR\tCould not copy benchdll_small.dll to %s: %lu\n", path, (unsigned long) GetLastError( ) );
+                ret = 1;
+                break;
+            }
+            handles[opened] = dlopen( path, RTLD_LOCAL );
+            if( !handles[opened] )
+            {
+                fprintf( stderr, "ERROR\tCould not open %s: %s\n", path, dlerror( ) );
+                DeleteFileA( path );
+                ret = 1;
+                break;
+            }
+        }
+
+        if( ret )
+            break;
+
+        /* Unique names, so every lookup walks all modules */
+        QueryPerformanceCounter( &start );
+        for( i = 0; i < iterations; i++ )
+        {
+            sprintf( name, "bench_missing_%lu_%lu", c, i );
+            dlsym( RTLD_DEFAULT, name );
+        }
+        QueryPerformanceCounter( &end );
+
+        sprintf( name, "dlsym default miss (%lu local objects)", counts[c] );
+        report( name, iterations, elapsed_ns( start, end ) );
+    }
+
+    while( opened > 0 )
+    {
+        opened--;
+        dlclose( handles[opened] );
+        sprintf( path, "bench_local_%03lu.dll", opened );
+        DeleteFileA( path );
+    }
+
+    return ret;
+}
+
+/* dlsym() hits and misses through an explicit handle */
+static int bench_dlsym_handle( unsigned long iterations )
+{
+    void *library;
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    library = dlopen( "benchdll_small.dll", RTLD_LOCAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_small.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    if( !dlsym( library, "bench_small_00007" ) )
+    {
+        fprintf( stderr, "ERROR\tCould not get symbol bench_small_00007: %s\n", dlerror( ) );
+        dlclose( library );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( library, "bench_small_00007" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym handle hit", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( library, "bench_missing" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym handle miss", iterations, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dlsym() hits and misses in the global scope and with RTLD_NEXT */
+static int bench_dlsym_global( unsigned long iterations )
+{
+    void *library;
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    library = dlopen( "benchdll_small.dll", RTLD_GLOBAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_small.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    if( !dlsym( RTLD_DEFAULT, "bench_small_00007" ) || !dlsym( RTLD_NEXT, "GetTickCount" ) )
+    {
+        fprintf( stderr, "ERROR\tCould not get symbol from global scope: %s\n", dlerror( ) );
+        dlclose( library );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_DEFAULT, "bench_small_00007" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym default hit", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_DEFAULT, "bench_missing" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym default miss", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_NEXT, "GetTickCount" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym next hit", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dlsym( RTLD_NEXT, "bench_missing" );
+    QueryPerformanceCounter( &end );
+    report( "dlsym next miss", iterations, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dladdr() on exported and non-exported functions and on an import thunk */
+static int bench_dladdr_kinds( unsigned long iterations )
+{
+    void *library;
+    void *exported;
+    Dl_info info;
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    library = dlopen( "benchdll_small.dll", RTLD_LOCAL );
+    if( !library )
+    {
+        fprintf( stderr, "ERROR\tCould not open benchdll_small.dll: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    exported = dlsym( library, "bench_small_00007" );
+    if( !exported || !dladdr( exported, &info ) || !dladdr( (void *) bench_local_function, &info ) || !dladdr( (void *) GetModuleHandleA, &info ) )
+    {
+        fprintf( stderr, "ERROR\tdladdr failed\n" );
+        dlclose( library );
+        return 1;
+    }
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dladdr( exported, &info );
+    QueryPerformanceCounter( &end );
+    report( "dladdr exported", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dladdr( (void *) bench_local_function, &info );
+    QueryPerformanceCounter( &end );
+    report( "dladdr non-exported", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+        dladdr( (void *) GetModuleHandleA, &info );
+    QueryPerformanceCounter( &end );
+    report( "dladdr import thunk", iterations, elapsed_ns( start, end ) );
+
+    dlclose( library );
+    return 0;
+}
+
+/* dlopen() and dlclose() of a dll which is not loaded yet and of a dll
+ * which is already loaded */
+static int bench_dlopen_cycles( unsigned long iterations )
+{
+    void *library;
+    LARGE_INTEGER start, end;
+    unsigned long i;
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+    {
+        library = dlopen( "benchdll_small.dll", RTLD_LOCAL );
+        if( !library )
+        {
+            fprintf( stderr, "ERROR\tCould not open benchdll_small.dll: %s\n", dlerror( ) );
+            return 1;
+        }
+        dlclose( library );
+    }
+    QueryPerformanceCounter( &end );
+    report( "dlopen+dlclose (load and unload)", iterations, elapsed_ns( start, end ) );
+
+    QueryPerformanceCounter( &start );
+    for( i = 0; i < iterations; i++ )
+    {
+        library = dlopen( "kernel32.dll", RTLD_GLOBAL );
+        if( !library )
+        {
+            fprintf( stderr, "ERROR\tCould not open kernel32.dll: %s\n", dlerror( ) );
+            return 1;
+        }
+        dlclose( library );
+    }
+    QueryPerformanceCounter( &end );
+    report( "dlopen+dlclose (already loaded)", iterations, elapsed_ns( start, end ) );
+
+    return 0;
+}
+
+int main( int argc, char **argv )
+{
+    unsigned long iterations = 10000;
+    int ret = 0;
+
+    if( !report_init( argc, argv, &iterations ) )
+        return 1;
+
+    ret |= bench_dlsym_handle( iterations );
+    ret |= bench_dlsym_global( iterations );
+    ret |= bench_dladdr_kinds( iterations );
+    ret |= bench_dlopen_cycles( iterations / 10 + 1 );
+    ret |= bench_dladdr_large( iterations );
+    ret |= bench_dlsym_large( iterations );
+    ret |= bench_dlsym_many_large( iterations / BENCH_BATCH + 1 );
+    ret |= bench_dlsym_local_objects( iterations );
+
+    report_finish( );
+
+    return ret;
+}
@@ -0,0 +1,47 @@
+#
+# Generate C source of a benchmark dll with many exported functions
+#
+# Usage: cmake -DOUTPUT=<file.c> -DCOUNT=<number of exports> [-DPREFIX=<name prefix>]
+#              [-DSHARED_COUNT=<number> -DSHARED_PREFIX=<name prefix>] -P gen-exports.cmake
+#
+# The first SHARED_COUNT exports are named with SHARED_PREFIX, so that several
+# dlls can export the same names.
+#
+if(NOT DEFINED OUTPUT OR NOT DEFINED COUNT)
+    message(FATAL_ERROR "OUTPUT and COUNT must be defined")
+endif()
+if(NOT DEFINED PREFIX)
+    set(PREFIX "bench_export_")
+endif()
+if(NOT DEFINED SHARED_COUNT)
+    set(SHARED_COUNT 0)
+endif()
+if(NOT DEFINED SHARED_PREFIX)
+    set(SHARED_PREFIX "bench_shared_")
+endif()
+
+file(WRITE ${OUTPUT} "/* Automatically generated by gen-exports.cmake, do not edit */\n\n")
+file(APPEND ${OUTPUT} "#if defined(_WIN32)\n#define EXPORT __declspec(dllexport)\n#else\n#define EXPORT\n#endif\n\n")
+
+math(EXPR _last "${COUNT} - 1")
+set(_chunk "")
+foreach(_i RANGE ${_last})
+    # zero padded number keeps names sorted in the same order as addresses
+    set(_num "0000${_i}")
+    string(LENGTH "${_num}" _len)
+    math(EXPR _start "${_len} - 5")
+    string(SUBSTRING "${_num}" ${_start} 5 _num)
+    # different bodies prevent folding of identical functions by the linker
+    if(_i LESS SHARED_COUNT)
+        set(_prefix "${SHARED_PREFIX}")
+    else()
+        set(_prefix "${PREFIX}")
+    endif()
+    set(_chunk "${_chunk}EXPORT int ${_prefix}${_num}( void ) { return ${_i}; }\n")
+    math(EXPR _mod "${_i} % 1000")
+    if(_mod EQUAL 999)
+        file(APPEND ${OUTPUT} "${_chunk}")
+        set(_chunk "")
+    endif()
+endforeach()
+file(APPEND ${OUTPUT} "${_chunk}")
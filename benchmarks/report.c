@@ -0,0 +1,101 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <windows.h>
+#include "report.h"
+
+int output = OUTPUT_TEXT;
+
+static unsigned long reported;
+static LARGE_INTEGER frequency;
+
+int report_init( int argc, char **argv, unsigned long *iterations )
+{
+    int i;
+
+    for( i = 1; i < argc; i++ )
+    {
+        if( strcmp( argv[i], "--csv" ) == 0 )
+            output = OUTPUT_CSV;
+        else if( strcmp( argv[i], "--json" ) == 0 )
+            output = OUTPUT_JSON;
+        else if( argv[i][0] >= '0' && argv[i][0] <= '9' )
+            *iterations = strtoul( argv[i], NULL, 10 );
+        else
+        {
+            fprintf( stderr, "Usage: %s [--csv|--json] [iterations]\n", argv[0] );
+            return 0;
+        }
+    }
+    if( *iterations == 0 )
+        *iterations = 1;
+
+    QueryPerformanceFrequency( &frequency );
+
+    return 1;
+}
+
+void report_finish( void )
+{
+    if( output == OUTPUT_JSON )
+        printf( "%s\n", reported == 0 ? "[]" : "\n]" );
+}
+
+double elapsed_ns( LARGE_INTEGER start, LARGE_INTEGER end )
+{
+    return (double) ( end.QuadPart - start.QuadPart ) * 1e9 / (double) frequency.QuadPart;
+}
+
+void report_scaled( const char *name, unsigned long dlls, unsigned long exports, unsigned long iterations, double ns )
+{
+    char label[128];
+
+    switch( output )
+    {
+    case OUTPUT_CSV:
+        if( reported == 0 )
+            printf( "benchmark,dlls,exports,calls,ns_per_call\n" );
+        printf( "\"%s\",%lu,%lu,%lu,%.1f\n", name, dlls, exports, iterations, ns / iterations );
+        break;
+    case OUTPUT_JSON:
+        printf( "%s\n    { \"benchmark\": \"%s\", \"dlls\": %lu, \"exports\": %lu, \"calls\": %lu, \"ns_per_call\": %.1f }",
+            reported == 0 ? "[" : ",", name, dlls, exports, iterations, ns / iterations );
+        break;
+    default:
+        if( dlls != 0 || exports != 0 )
+            sprintf( label, "%.64s (%lu dlls, %lu exports)", name, dlls, exports );
+        else
+            sprintf( label, "%.64s", name );
+        printf( "%-56s %10lu calls %14.1f ns/call\n", label, iterations, ns / iterations );
+        break;
+    }
+    reported++;
+}
+
+void report( const char *name, unsigned long iterations, double ns )
+{
+    report_scaled( name, 0, 0, iterations, ns );
+}
@@ -0,0 +1,52 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BENCH_REPORT_H
+#define BENCH_REPORT_H
+
+#include <windows.h>
+
+/* Output format of results */
+enum {
+    OUTPUT_TEXT,
+    OUTPUT_CSV,
+    OUTPUT_JSON
+};
+
+extern int output;
+
+/* Parse --csv, --json and number of iterations, return 0 on invalid argument */
+int report_init( int argc, char **argv, unsigned long *iterations );
+
+/* Terminate output, must be called after the last result */
+void report_finish( void );
+
+double elapsed_ns( LARGE_INTEGER start, LARGE_INTEGER end );
+
+/* Print result of a benchmark */
+void report( const char *name, unsigned long iterations, double ns );
+
+/* Print result of a benchmark run with the given number of loaded dlls and
+ * exports per dll */
+void report_scaled( const char *name, unsigned long dlls, unsigned long exports, unsigned long iterations, double ns );
+
+#endif /* BENCH_REPORT_H */
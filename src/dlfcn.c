@@ -45,6 +45,9 @@ typedef ULONG ULONG_PTR;
 #ifndef GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT
 #define GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT 0x2
 #endif
+#ifndef GET_MODULE_HANDLE_EX_FLAG_PIN
+#define GET_MODULE_HANDLE_EX_FLAG_PIN 0x1
+#endif
 #ifndef IMAGE_NT_OPTIONAL_HDR_MAGIC
 #ifdef _WIN64
 #define IMAGE_NT_OPTIONAL_HDR_MAGIC 0x20b
@@ -85,6 +88,8 @@ __declspec( naked ) static void *_ReturnAddress( void ) { __asm mov eax, [ebp+4]
 #define DLFCN_WIN32_EXPORTS
 #endif
 #include "dlfcn.h"
+#include "pe.h"
+#include "expidx.h"
 
 #if defined( _MSC_VER ) && _MSC_VER >= 1300
 /* https://docs.microsoft.com/en-us/cpp/cpp/noinline */
@@ -96,129 +101,695 @@ __declspec( naked ) static void *_ReturnAddress( void ) { __asm mov eax, [ebp+4]
 #define DLFCN_NOINLINE
 #endif
 
+/* x86 does not reorder loads, so only the compiler has to be prevented from
+ * moving loads before the read of a flag which publishes initialized data.
+ * MSVC gives volatile reads acquire semantics on x86 by default.
+ */
+#if defined( _M_IX86 ) || defined( _M_AMD64 ) || defined( __i386__ ) || defined( __x86_64__ )
+#if defined( __GNUC__ )
+#define DLFCN_ACQUIRE_BARRIER( ) __asm__ __volatile__( "" : : : "memory" )
+#else
+#define DLFCN_ACQUIRE_BARRIER( )
+#endif
+#else
+#define DLFCN_ACQUIRE_BARRIER( ) MemoryBarrier( )
+#endif
+
 /* Note:
- * MSDN says these functions are not thread-safe. We make no efforts to have
- * any kind of thread safety.
+ * MSDN says these functions are not thread-safe. Internal state is protected
+ * by a reader/writer lock: lookups take it shared, dlopen( ), dlclose( ) and
+ * cache updates take it exclusive. No loader function may be called while
+ * the lock is held, because loader notifications and DllMain( ) of loaded
+ * modules may call into this library with the loader lock held.
  */
 
-typedef struct local_object {
-    HMODULE hModule;
-    struct local_object *previous;
-    struct local_object *next;
-} local_object;
+/* SRW locks are available since Windows Vista, older systems use a critical
+ * section for both shared and exclusive access. */
+static VOID (WINAPI *AcquireSRWLockSharedPtr)(PVOID *) = NULL;
+static VOID (WINAPI *ReleaseSRWLockSharedPtr)(PVOID *) = NULL;
+static VOID (WINAPI *AcquireSRWLockExclusivePtr)(PVOID *) = NULL;
+static VOID (WINAPI *ReleaseSRWLockExclusivePtr)(PVOID *) = NULL;
+static PVOID state_srwlock; /* SRWLOCK has the size of a pointer and is initialized to zero */
+static CRITICAL_SECTION state_cs;
+
+static void lock_init( void )
+{
+    HMODULE kernel32;
+
+    kernel32 = GetModuleHandleA( "Kernel32.dll" );
+    if( kernel32 != NULL )
+    {
+        AcquireSRWLockSharedPtr = (VOID (WINAPI *)(PVOID *)) (LPVOID) GetProcAddress( kernel32, "AcquireSRWLockShared" );
+        ReleaseSRWLockSharedPtr = (VOID (WINAPI *)(PVOID *)) (LPVOID) GetProcAddress( kernel32, "ReleaseSRWLockShared" );
+        AcquireSRWLockExclusivePtr = (VOID (WINAPI *)(PVOID *)) (LPVOID) GetProcAddress( kernel32, "AcquireSRWLockExclusive" );
+        ReleaseSRWLockExclusivePtr = (VOID (WINAPI *)(PVOID *)) (LPVOID) GetProcAddress( kernel32, "ReleaseSRWLockExclusive" );
+    }
+
+    if( AcquireSRWLockSharedPtr == NULL || ReleaseSRWLockSharedPtr == NULL || AcquireSRWLockExclusivePtr == NULL || ReleaseSRWLockExclusivePtr == NULL )
+    {
+        AcquireSRWLockSharedPtr = NULL;
+        InitializeCriticalSection( &state_cs );
+    }
+}
 
-static local_object first_object;
+static void lock_shared( void )
+{
+    if( AcquireSRWLockSharedPtr != NULL )
+        AcquireSRWLockSharedPtr( &state_srwlock );
+    else
+        EnterCriticalSection( &state_cs );
+}
 
-/* These functions implement a double linked list for the local objects. */
-static local_object *local_search( HMODULE hModule )
+static void unlock_shared( void )
 {
-    local_object *pobject;
+    if( AcquireSRWLockSharedPtr != NULL )
+        ReleaseSRWLockSharedPtr( &state_srwlock );
+    else
+        LeaveCriticalSection( &state_cs );
+}
 
-    if( hModule == NULL )
-        return NULL;
+static void lock_exclusive( void )
+{
+    if( AcquireSRWLockSharedPtr != NULL )
+        AcquireSRWLockExclusivePtr( &state_srwlock );
+    else
+        EnterCriticalSection( &state_cs );
+}
 
-    for( pobject = &first_object; pobject; pobject = pobject->next )
-        if( pobject->hModule == hModule )
-            return pobject;
+static void unlock_exclusive( void )
+{
+    if( AcquireSRWLockSharedPtr != NULL )
+        ReleaseSRWLockExclusivePtr( &state_srwlock );
+    else
+        LeaveCriticalSection( &state_cs );
+}
 
-    return NULL;
+/* Set of modules loaded with RTLD_LOCAL. It is an open addressing hash table
+ * with linear probing and at most half full. Removal shifts following
+ * entries back, so no deleted markers are needed.
+ */
+static HMODULE *local_objects;
+static size_t local_objects_size;
+static size_t local_objects_count;
+
+/* Modules are aligned to the allocation granularity (64K), so the lower 16
+ * bits of HMODULE are always zero. Fibonacci hashing spreads the rest.
+ */
+static size_t local_hash( HMODULE hModule, size_t size )
+{
+    return (size_t) ( ( (DWORD) ( (ULONG_PTR) hModule >> 16 ) * 2654435761U ) & ( size - 1 ) );
+}
+
+/* These functions implement a hash set for the local objects. */
+static BOOL local_search( HMODULE hModule )
+{
+    size_t slot;
+
+    if( hModule == NULL || local_objects_count == 0 )
+        return FALSE;
+
+    for( slot = local_hash( hModule, local_objects_size ); local_objects[slot] != NULL; slot = ( slot + 1 ) & ( local_objects_size - 1 ) )
+        if( local_objects[slot] == hModule )
+            return TRUE;
+
+    return FALSE;
+}
+
+static void local_insert( HMODULE *objects, size_t size, HMODULE hModule )
+{
+    size_t slot;
+
+    for( slot = local_hash( hModule, size ); objects[slot] != NULL; slot = ( slot + 1 ) & ( size - 1 ) );
+
+    objects[slot] = hModule;
 }
 
 static BOOL local_add( HMODULE hModule )
 {
-    local_object *pobject;
-    local_object *nobject;
+    HMODULE *objects;
+    size_t i, size;
 
     if( hModule == NULL )
         return TRUE;
 
-    pobject = local_search( hModule );
-
-    /* Do not add object again if it's already on the list */
-    if( pobject != NULL )
+    /* Do not add object again if it's already in the set */
+    if( local_search( hModule ) )
         return TRUE;
 
-    for( pobject = &first_object; pobject->next; pobject = pobject->next );
+    if( 2 * ( local_objects_count + 1 ) > local_objects_size )
+    {
+        size = local_objects_size ? 2 * local_objects_size : 16;
+        objects = (HMODULE *) calloc( size, sizeof( HMODULE ) );
 
-    nobject = (local_object *) malloc( sizeof( local_object ) );
+        if( !objects )
+            return FALSE;
 
-    if( !nobject )
-        return FALSE;
+        for( i = 0; i < local_objects_size; i++ )
+            if( local_objects[i] != NULL )
+                local_insert( objects, size, local_objects[i] );
 
-    pobject->next = nobject;
-    nobject->next = NULL;
-    nobject->previous = pobject;
-    nobject->hModule = hModule;
+        free( local_objects );
+        local_objects = objects;
+        local_objects_size = size;
+    }
+
+    local_insert( local_objects, local_objects_size, hModule );
+    local_objects_count++;
 
     return TRUE;
 }
 
 static void local_rem( HMODULE hModule )
 {
-    local_object *pobject;
+    size_t slot, next, home;
 
-    if( hModule == NULL )
+    if( hModule == NULL || local_objects_count == 0 )
         return;
 
-    pobject = local_search( hModule );
+    for( slot = local_hash( hModule, local_objects_size ); local_objects[slot] != hModule; slot = ( slot + 1 ) & ( local_objects_size - 1 ) )
+        if( local_objects[slot] == NULL )
+            return;
 
-    if( pobject == NULL )
-        return;
+    /* Move back following entries which would not be found after the slot
+     * becomes empty */
+    for( next = ( slot + 1 ) & ( local_objects_size - 1 ); local_objects[next] != NULL; next = ( next + 1 ) & ( local_objects_size - 1 ) )
+    {
+        home = local_hash( local_objects[next], local_objects_size );
+        if( ( ( next - home ) & ( local_objects_size - 1 ) ) >= ( ( next - slot ) & ( local_objects_size - 1 ) ) )
+        {
+            local_objects[slot] = local_objects[next];
+            slot = next;
+        }
+    }
+
+    local_objects[slot] = NULL;
+    local_objects_count--;
+}
+
+/* Entry of the export table index sorted by function address. This and the
+ * name slot are also the layout of export index files, see expidx.h.
+ */
+typedef struct export_entry {
+    DWORD rva;      /* RVA of the exported function */
+    DWORD name;     /* RVA of the first name for the function or zero */
+    DWORD index;    /* Index into AddressOfFunctions */
+} export_entry;
+
+/* Slot of the export name hash table */
+typedef struct export_name_slot {
+    DWORD hash;     /* Hash of the name */
+    DWORD index;    /* Index into AddressOfNames + 1 or zero for empty slot */
+} export_name_slot;
+
+/* Header of export index file, see expidx.h */
+typedef struct export_index_header {
+    char magic[4];
+    DWORD version;
+    DWORD timestamp;
+    DWORD checksum;
+    DWORD size_of_image;
+    DWORD exports_count;
+    DWORD names_size;
+    DWORD reserved;
+} export_index_header;
+
+/* Data computed from the image of a module and cached until dlclose() */
+typedef struct module_data {
+    HMODULE hModule;
+    /* Values from the image used to detect that a different module was
+     * loaded at the same address */
+    DWORD dwTimeDateStamp;
+    DWORD dwSizeOfImage;
+    /* Number of not yet closed dlopen() calls which returned this module */
+    DWORD open_count;
+    /* Opened with RTLD_NODELETE, the data and the loader reference of the
+     * library are kept even when the module is not open */
+    BOOL pinned;
+    /* Delay-loaded imports were bound by dlopen() */
+    BOOL delay_bound;
+    /* Export table sorted by rva or NULL when not built yet */
+    export_entry *exports;
+    DWORD exports_count;
+    /* Hash table of export names or NULL when not built yet */
+    export_name_slot *names;
+    DWORD names_size;
+    /* Path of the module returned by dladdr() or NULL when not known yet */
+    char *filename;
+    /* Export index holding both tables, either mapped from the export index
+     * file or built from the image, or NULL */
+    const void *index_view;
+    unsigned char *index_data;
+    struct module_data *next;
+} module_data;
+
+/* Modules are aligned to the allocation granularity (64K), so lower 16 bits
+ * of HMODULE are always zero and do not need to be hashed.
+ */
+#define MODULE_DATA_BUCKETS 64
+#define MODULE_DATA_HASH( hModule ) ( ( (ULONG_PTR) (hModule) >> 16 ) % MODULE_DATA_BUCKETS )
+
+static module_data *module_data_table[MODULE_DATA_BUCKETS];
+
+/* These functions implement a hash table of module data keyed by HMODULE. */
+static module_data *module_data_search( HMODULE hModule )
+{
+    module_data *pdata;
+
+    for( pdata = module_data_table[MODULE_DATA_HASH( hModule )]; pdata; pdata = pdata->next )
+        if( pdata->hModule == hModule )
+            return pdata;
+
+    return NULL;
+}
+
+static module_data *module_data_add( HMODULE hModule )
+{
+    module_data *pdata;
+    size_t bucket;
+
+    pdata = module_data_search( hModule );
+
+    if( pdata != NULL )
+        return pdata;
+
+    pdata = (module_data *) calloc( 1, sizeof( module_data ) );
+
+    if( !pdata )
+        return NULL;
+
+    bucket = MODULE_DATA_HASH( hModule );
+    pdata->hModule = hModule;
+    pdata->next = module_data_table[bucket];
+    module_data_table[bucket] = pdata;
+
+    return pdata;
+}
+
+static void module_data_clear( module_data *pdata )
+{
+    if( pdata->index_view != NULL )
+    {
+        UnmapViewOfFile( pdata->index_view );
+        pdata->index_view = NULL;
+    }
+    free( pdata->index_data );
+    pdata->index_data = NULL;
+    pdata->exports = NULL;
+    pdata->exports_count = 0;
+    pdata->names = NULL;
+    pdata->names_size = 0;
+    free( pdata->filename );
+    pdata->filename = NULL;
+}
+
+static void module_data_rem( HMODULE hModule )
+{
+    module_data **ppdata;
+    module_data *pdata;
+
+    for( ppdata = &module_data_table[MODULE_DATA_HASH( hModule )]; *ppdata; ppdata = &(*ppdata)->next )
+    {
+        if( (*ppdata)->hModule == hModule )
+        {
+            pdata = *ppdata;
+            *ppdata = pdata->next;
+            module_data_clear( pdata );
+            free( pdata );
+            return;
+        }
+    }
+}
+
+/* Data of a module opened by dlopen() are kept until the last dlclose().
+ * Returns NULL when the data could not be allocated.
+ */
+static module_data *module_data_open( HMODULE hModule )
+{
+    module_data *pdata;
+
+    pdata = module_data_add( hModule );
+
+    /* Module data are only a cache, so allocation failure is not fatal */
+    if( pdata != NULL )
+        pdata->open_count++;
+
+    return pdata;
+}
+
+/* Drop data of a module after its last dlclose(), unless the module was
+ * opened again meanwhile.
+ */
+static void module_data_close( HMODULE hModule )
+{
+    module_data *pdata;
+
+    pdata = module_data_search( hModule );
+
+    if( pdata == NULL || pdata->open_count == 0 )
+        module_data_rem( hModule );
+}
+
+static BOOL module_data_is_open( HMODULE hModule )
+{
+    module_data *pdata;
+    BOOL ret;
+
+    lock_shared( );
+    pdata = module_data_search( hModule );
+    ret = pdata != NULL && pdata->open_count > 0;
+    unlock_shared( );
+
+    return ret;
+}
+
+/* State of a thread, the error and statistics counters. The message buffer
+ * is allocated when the first error occurs in the thread and grows when a
+ * longer message is stored.
+ */
+typedef struct thread_state {
+    BOOL occurred;
+    BOOL pending;       /* localized message not yet appended */
+    DWORD code;
+    char *message;
+    size_t length;      /* length of the argument part of message */
+    size_t size;
+    dlfcn_win32_stats stats;    /* times are in performance counter ticks */
+    struct thread_state *prev;  /* list of states of running threads */
+    struct thread_state *next;
+} thread_state;
+
+/* Used when no thread local storage is available */
+static thread_state thread_fallback;
+
+/* States of running threads and counters of finished threads, needed only by
+ * dlfcn_win32_get_stats( ). Other threads read the counters of a thread while
+ * it updates them and all threads share thread_fallback when no thread local
+ * storage could be allocated, so every counter is read and updated with an
+ * interlocked operation. The sum can still be slightly off while other threads
+ * use the library, but no counter is ever seen half updated or loses updates.
+ */
+static CRITICAL_SECTION thread_list_lock;
+static thread_state *thread_list;
+static dlfcn_win32_stats stats_retired;
+static dlfcn_win32_stats stats_baseline;
+static LARGE_INTEGER stats_frequency;
+
+#define STATS_COUNTERS ( sizeof( dlfcn_win32_stats ) / sizeof( unsigned long long ) )
+
+#define STATS_ADD( counter, value ) InterlockedExchangeAdd64( (LONGLONG volatile *) &(counter), (LONGLONG) (value) )
+
+static void stats_add( dlfcn_win32_stats *dst, dlfcn_win32_stats *src )
+{
+    unsigned long long *d = (unsigned long long *) dst;
+    unsigned long long *s = (unsigned long long *) src;
+    size_t i;
+
+    for( i = 0; i < STATS_COUNTERS; i++ )
+        d[i] += (unsigned long long) InterlockedCompareExchange64( (LONGLONG volatile *) &s[i], 0, 0 );
+}
+
+static char error_no_memory[] = "Not enough memory to store error message";
+
+/* Fiber local storage is available since Windows Vista and calls a callback
+ * which frees the state when a thread exits. Older systems use thread local
+ * storage, which is freed by DllMain( ) of the shared library.
+ */
+static DWORD (WINAPI *FlsAllocPtr)(PVOID) = NULL;
+static PVOID (WINAPI *FlsGetValuePtr)(DWORD) = NULL;
+static BOOL (WINAPI *FlsSetValuePtr)(DWORD, PVOID) = NULL;
+static BOOL (WINAPI *FlsFreePtr)(DWORD) = NULL;
+static DWORD thread_index = TLS_OUT_OF_INDEXES;
 
-    if( pobject->next )
-        pobject->next->previous = pobject->previous;
-    if( pobject->previous )
-        pobject->previous->next = pobject->next;
+/* Set by thread_fini( ), states of other threads are not freed anymore */
+static volatile BOOL thread_exiting = FALSE;
 
-    free( pobject );
+static void thread_state_release( thread_state *state )
+{
+    if( state != NULL && state != &thread_fallback )
+    {
+        EnterCriticalSection( &thread_list_lock );
+        stats_add( &stats_retired, &state->stats );
+        if( state->prev != NULL )
+            state->prev->next = state->next;
+        else
+            thread_list = state->next;
+        if( state->next != NULL )
+            state->next->prev = state->prev;
+        LeaveCriticalSection( &thread_list_lock );
+
+        free( state->message );
+        free( state );
+    }
+}
+
+static VOID WINAPI thread_state_free( PVOID data )
+{
+    if( !thread_exiting )
+        thread_state_release( (thread_state *) data );
+}
+
+/* FlsFree( ) calls the callback for states of all threads, but other threads
+ * can still be running and use their states, e.g. in a late dlerror( ). So
+ * only the state of the exiting thread is freed and the others are left to
+ * the process exit, as with DLL_PROCESS_DETACH.
+ */
+static void thread_fini( void )
+{
+    DWORD index = thread_index;
+    thread_state *state;
+
+    thread_exiting = TRUE;
+    thread_index = TLS_OUT_OF_INDEXES;
+
+    if( FlsFreePtr != NULL )
+    {
+        state = (thread_state *) FlsGetValuePtr( index );
+        FlsFreePtr( index );
+    }
+    else
+    {
+        state = (thread_state *) TlsGetValue( index );
+        TlsFree( index );
+    }
+
+    thread_state_release( state );
+}
+
+/* Called once by global_init( ) */
+static void thread_init( void )
+{
+    HMODULE kernel32;
+
+    InitializeCriticalSection( &thread_list_lock );
+    QueryPerformanceFrequency( &stats_frequency );
+
+    kernel32 = GetModuleHandleA( "Kernel32.dll" );
+    if( kernel32 != NULL )
+    {
+        FlsAllocPtr = (DWORD (WINAPI *)(PVOID)) (LPVOID) GetProcAddress( kernel32, "FlsAlloc" );
+        FlsGetValuePtr = (PVOID (WINAPI *)(DWORD)) (LPVOID) GetProcAddress( kernel32, "FlsGetValue" );
+        FlsSetValuePtr = (BOOL (WINAPI *)(DWORD, PVOID)) (LPVOID) GetProcAddress( kernel32, "FlsSetValue" );
+        FlsFreePtr = (BOOL (WINAPI *)(DWORD)) (LPVOID) GetProcAddress( kernel32, "FlsFree" );
+    }
+
+    if( FlsAllocPtr != NULL && FlsGetValuePtr != NULL && FlsSetValuePtr != NULL && FlsFreePtr != NULL )
+        thread_index = FlsAllocPtr( (PVOID) thread_state_free );
+
+    if( thread_index == TLS_OUT_OF_INDEXES )
+    {
+        FlsFreePtr = NULL;
+        thread_index = TlsAlloc( );
+    }
+
+    /* Callback must not stay registered after this code is unloaded */
+    if( thread_index != TLS_OUT_OF_INDEXES )
+        atexit( thread_fini );
+}
+
+/* Free state of the current thread, needed only without fiber local storage */
+static void thread_detach( void )
+{
+    DWORD index = thread_index;
+
+    if( FlsFreePtr == NULL && index != TLS_OUT_OF_INDEXES )
+    {
+        thread_state_free( TlsGetValue( index ) );
+        TlsSetValue( index, NULL );
+    }
 }
 
-/* POSIX says dlerror( ) doesn't have to be thread-safe, so we use one
- * static buffer.
- * MSDN says the buffer cannot be larger than 64K bytes, so we set it to
- * the limit.
+/* Get state of the current thread. Without create, NULL is returned for
+ * threads which did not use the library yet.
  */
-static char error_buffer[65535];
-static BOOL error_occurred;
+static thread_state *thread_state_get( BOOL create )
+{
+    DWORD index = thread_index;
+    thread_state *state;
+    BOOL ret;
+
+    if( index == TLS_OUT_OF_INDEXES )
+        return &thread_fallback;
+
+    if( FlsFreePtr != NULL )
+        state = (thread_state *) FlsGetValuePtr( index );
+    else
+        state = (thread_state *) TlsGetValue( index );
+
+    if( state != NULL || !create )
+        return state;
+
+    state = (thread_state *) calloc( 1, sizeof( thread_state ) );
+    if( state == NULL )
+        return &thread_fallback;
+
+    if( FlsFreePtr != NULL )
+        ret = FlsSetValuePtr( index, state );
+    else
+        ret = TlsSetValue( index, state );
+
+    if( !ret )
+    {
+        free( state );
+        return &thread_fallback;
+    }
+
+    EnterCriticalSection( &thread_list_lock );
+    state->next = thread_list;
+    if( thread_list != NULL )
+        thread_list->prev = state;
+    thread_list = state;
+    LeaveCriticalSection( &thread_list_lock );
+
+    return state;
+}
+
+/* Get statistics counters of the current thread */
+static dlfcn_win32_stats *stats_get( void )
+{
+    return &thread_state_get( TRUE )->stats;
+}
+
+/* Performance counter for measuring time spent in the loader */
+static ULONGLONG stats_ticks( void )
+{
+    LARGE_INTEGER counter;
+
+    QueryPerformanceCounter( &counter );
+
+    return (ULONGLONG) counter.QuadPart;
+}
+
+/* Convert performance counter ticks to nanoseconds without overflow */
+static unsigned long long stats_ticks_to_ns( unsigned long long ticks )
+{
+    unsigned long long frequency = (unsigned long long) stats_frequency.QuadPart;
 
+    if( frequency == 0 )
+        return 0;
+
+    return ticks / frequency * 1000000000 + ticks % frequency * 1000000000 / frequency;
+}
+
+/* Forget previous error of the current thread */
+static void error_clear( void )
+{
+    thread_state *state = thread_state_get( FALSE );
+
+    if( state != NULL && state->occurred )
+        state->occurred = FALSE;
+}
+
+/* Enlarge message buffer of the state to at least size bytes */
+static BOOL error_reserve( thread_state *state, size_t size )
+{
+    char *buffer;
+
+    if( size <= state->size )
+        return TRUE;
+
+    if( size < 256 )
+        size = 256;
+
+    buffer = (char *) realloc( state->message, size );
+    if( buffer == NULL )
+        return FALSE;
+
+    state->message = buffer;
+    state->size = size;
+
+    return TRUE;
+}
+
+/* Record the failure. Looking up the localized message is expensive and
+ * most failed lookups are never reported, so only the argument is stored
+ * here and the message is appended by error_format( ) from dlerror( ).
+ */
 static void save_err_str( const char *str, DWORD dwMessageId )
 {
-    DWORD ret;
+    thread_state *state;
     size_t pos, len;
 
+    state = thread_state_get( TRUE );
+    state->occurred = TRUE;
+    state->pending = TRUE;
+    state->code = dwMessageId;
+
     len = strlen( str );
-    if( len > sizeof( error_buffer ) - 5 )
-        len = sizeof( error_buffer ) - 5;
+
+    if( !error_reserve( state, len + 5 ) )
+    {
+        if( state->message == NULL )
+            return;
+        len = state->size - 5;
+    }
 
     /* Format error message to:
      * "<argument to function that failed>": <Windows localized error message>
       */
     pos = 0;
-    error_buffer[pos++] = '"';
-    memcpy( error_buffer + pos, str, len );
+    state->message[pos++] = '"';
+    memcpy( state->message + pos, str, len );
     pos += len;
-    error_buffer[pos++] = '"';
-    error_buffer[pos++] = ':';
-    error_buffer[pos++] = ' ';
+    state->message[pos++] = '"';
+    state->message[pos++] = ':';
+    state->message[pos++] = ' ';
+    state->message[pos] = '\0';
+    state->length = pos;
+}
+
+/* Append localized message for the recorded error code */
+static void error_format( thread_state *state )
+{
+    char *message;
+    DWORD ret;
+
+    state->pending = FALSE;
+
+    if( state->message == NULL )
+        return;
 
-    ret = FormatMessageA( FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, dwMessageId,
+    STATS_ADD( state->stats.format_message_calls, 1 );
+
+    ret = FormatMessageA( FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM | FORMAT_MESSAGE_IGNORE_INSERTS, NULL, state->code,
         MAKELANGID( LANG_NEUTRAL, SUBLANG_DEFAULT ),
-        error_buffer + pos, (DWORD) ( sizeof( error_buffer ) - pos ), NULL );
-    pos += ret;
+        (LPSTR) &message, 0, NULL );
 
-    /* When FormatMessageA() fails it returns zero and does not touch buffer
-     * so add trailing null byte */
+    /* When FormatMessageA() fails it returns zero and does not allocate buffer */
     if( ret == 0 )
-        error_buffer[pos] = '\0';
+        return;
 
-    if( pos > 1 )
-    {
-        /* POSIX says the string must not have trailing <newline> */
-        if( error_buffer[pos-2] == '\r' && error_buffer[pos-1] == '\n' )
-            error_buffer[pos-2] = '\0';
-    }
+    /* POSIX says the string must not have trailing <newline> */
+    if( ret >= 2 && message[ret-2] == '\r' && message[ret-1] == '\n' )
+        ret -= 2;
 
-    error_occurred = TRUE;
+    /* Truncate the message if the buffer cannot be enlarged */
+    if( !error_reserve( state, state->length + ret + 1 ) && state->length + ret + 1 > state->size )
+        ret = (DWORD) ( state->size - state->length - 1 );
+
+    memcpy( state->message + state->length, message, ret );
+    state->message[state->length + ret] = '\0';
+
+    LocalFree( message );
 }
 
 static void save_err_ptr_str( const void *ptr, DWORD dwMessageId )
@@ -270,14 +841,13 @@ static UINT MySetErrorMode( UINT uMode )
     }
 }
 
-static HMODULE MyGetModuleHandleFromAddress( const void *addr )
+/* GetModuleHandleExA is not available on Windows 2000, where this fails with
+ * ERROR_CALL_NOT_IMPLEMENTED */
+static BOOL MyGetModuleHandleExA( DWORD dwFlags, LPCSTR lpModuleName, HMODULE *phModule )
 {
     static BOOL (WINAPI *GetModuleHandleExAPtr)(DWORD, LPCSTR, HMODULE *) = NULL;
     static BOOL failed = FALSE;
     HMODULE kernel32;
-    HMODULE hModule;
-    MEMORY_BASIC_INFORMATION info;
-    size_t sLen;
 
     if( !failed && GetModuleHandleExAPtr == NULL )
     {
@@ -288,36 +858,90 @@ static HMODULE MyGetModuleHandleFromAddress( const void *addr )
             failed = TRUE;
     }
 
-    if( !failed )
-    {
-        /* If GetModuleHandleExA is available use it with GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS */
-        if( !GetModuleHandleExAPtr( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, addr, &hModule ) )
-            return NULL;
-    }
-    else
+    if( failed )
     {
-        /* To get HMODULE from address use undocumented hack from https://stackoverflow.com/a/2396380
-         * The HMODULE of a DLL is the same value as the module's base address.
-         */
-        sLen = VirtualQuery( addr, &info, sizeof( info ) );
-        if( sLen != sizeof( info ) )
-            return NULL;
-        hModule = (HMODULE) info.AllocationBase;
+        SetLastError( ERROR_CALL_NOT_IMPLEMENTED );
+        return FALSE;
     }
 
-    return hModule;
+    return GetModuleHandleExAPtr( dwFlags, lpModuleName, phModule );
 }
 
-/* Load Psapi.dll at runtime, this avoids linking caveat */
-static BOOL MyEnumProcessModules( HANDLE hProcess, HMODULE *lphModule, DWORD cb, LPDWORD lpcbNeeded )
+static HMODULE MyGetModuleHandleFromAddress( const void *addr )
 {
-    static BOOL (WINAPI *EnumProcessModulesPtr)(HANDLE, HMODULE *, DWORD, LPDWORD) = NULL;
-    static BOOL failed = FALSE;
-    UINT uMode;
-    HMODULE psapi;
+    HMODULE hModule;
+    MEMORY_BASIC_INFORMATION info;
+    size_t sLen;
 
-    if( failed )
-        return FALSE;
+    /* If GetModuleHandleExA is available use it with GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS */
+    if( MyGetModuleHandleExA( GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, addr, &hModule ) )
+        return hModule;
+
+    if( GetLastError( ) != ERROR_CALL_NOT_IMPLEMENTED )
+        return NULL;
+
+    /* To get HMODULE from address use undocumented hack from https://stackoverflow.com/a/2396380
+     * The HMODULE of a DLL is the same value as the module's base address.
+     */
+    sLen = VirtualQuery( addr, &info, sizeof( info ) );
+    if( sLen != sizeof( info ) )
+        return NULL;
+    hModule = (HMODULE) info.AllocationBase;
+
+    return hModule;
+}
+
+/* Get module of the name if it is loaded and add a reference to it, like
+ * LoadLibrary( ) which never loads anything */
+static HMODULE MyGetModuleHandleRef( LPCSTR lpModuleName )
+{
+    char lpFileName[MAX_PATH];
+    HMODULE hModule;
+    DWORD dwLen;
+
+    if( MyGetModuleHandleExA( 0, lpModuleName, &hModule ) )
+        return hModule;
+
+    if( GetLastError( ) != ERROR_CALL_NOT_IMPLEMENTED )
+        return NULL;
+
+    /* Without GetModuleHandleExA (Windows 2000) loading the file of the
+     * loaded module only adds a reference to it */
+    hModule = GetModuleHandleA( lpModuleName );
+    if( hModule == NULL )
+        return NULL;
+
+    dwLen = GetModuleFileNameA( hModule, lpFileName, sizeof( lpFileName ) );
+    if( dwLen == 0 )
+        return NULL;
+    if( dwLen >= sizeof( lpFileName ) )
+    {
+        SetLastError( ERROR_FILENAME_EXCED_RANGE );
+        return NULL;
+    }
+
+    return LoadLibraryA( lpFileName );
+}
+
+/* Keep the module loaded until the process exits, whatever FreeLibrary( )
+ * calls follow. Not supported without GetModuleHandleExA (Windows 2000). */
+static BOOL MyPinModule( HMODULE hModule )
+{
+    HMODULE hPinned;
+
+    return MyGetModuleHandleExA( GET_MODULE_HANDLE_EX_FLAG_PIN | GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCSTR) hModule, &hPinned );
+}
+
+/* Load Psapi.dll at runtime, this avoids linking caveat */
+static BOOL MyEnumProcessModules( HANDLE hProcess, HMODULE *lphModule, DWORD cb, LPDWORD lpcbNeeded )
+{
+    static BOOL (WINAPI *EnumProcessModulesPtr)(HANDLE, HMODULE *, DWORD, LPDWORD) = NULL;
+    static BOOL failed = FALSE;
+    UINT uMode;
+    HMODULE psapi;
+
+    if( failed )
+        return FALSE;
 
     if( EnumProcessModulesPtr == NULL )
     {
@@ -334,30 +958,1788 @@ static BOOL MyEnumProcessModules( HANDLE hProcess, HMODULE *lphModule, DWORD cb,
             psapi = LoadLibraryA( "Psapi.dll" );
             if( psapi != NULL )
             {
-                EnumProcessModulesPtr = (BOOL (WINAPI *)(HANDLE, HMODULE *, DWORD, LPDWORD)) (LPVOID) GetProcAddress( psapi, "EnumProcessModules" );
-                if( EnumProcessModulesPtr == NULL )
-                    FreeLibrary( psapi );
+                EnumProcessModulesPtr = (BOOL (WINAPI *)(HANDLE, HMODULE *, DWORD, LPDWORD)) (LPVOID) GetProcAddress( psapi, "EnumProcessModules" );
+                if( EnumProcessModulesPtr == NULL )
+                    FreeLibrary( psapi );
+            }
+            MySetErrorMode( uMode );
+        }
+
+        if( EnumProcessModulesPtr == NULL )
+        {
+            failed = TRUE;
+            return FALSE;
+        }
+    }
+
+    STATS_ADD( stats_get( )->enum_process_modules_calls, 1 );
+
+    return EnumProcessModulesPtr( hProcess, lphModule, cb, lpcbNeeded );
+}
+
+/* See https://docs.microsoft.com/en-us/archive/msdn-magazine/2002/march/inside-windows-an-in-depth-look-into-the-win32-portable-executable-file-format-part-2
+ * for details */
+
+/* Get NT headers of the module image */
+static IMAGE_NT_HEADERS *get_nt_headers( HMODULE module )
+{
+    IMAGE_DOS_HEADER *dosHeader;
+    IMAGE_NT_HEADERS *ntHeaders;
+
+    dosHeader = (IMAGE_DOS_HEADER *) module;
+
+    if( dosHeader->e_magic != IMAGE_DOS_SIGNATURE )
+        return NULL;
+
+    ntHeaders = (IMAGE_NT_HEADERS *) ( (BYTE *) dosHeader + dosHeader->e_lfanew );
+
+    if( ntHeaders->Signature != IMAGE_NT_SIGNATURE )
+        return NULL;
+
+    if( ntHeaders->OptionalHeader.Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC )
+        return NULL;
+
+    return ntHeaders;
+}
+
+/* Get specific image section */
+static BOOL get_image_section( HMODULE module, int index, void **ptr, DWORD *size )
+{
+    IMAGE_NT_HEADERS *ntHeaders;
+    IMAGE_OPTIONAL_HEADER *optionalHeader;
+
+    ntHeaders = get_nt_headers( module );
+
+    if( ntHeaders == NULL )
+        return FALSE;
+
+    optionalHeader = &ntHeaders->OptionalHeader;
+
+    if( index < 0 || index >= IMAGE_NUMBEROF_DIRECTORY_ENTRIES || index >= optionalHeader->NumberOfRvaAndSizes )
+        return FALSE;
+
+    if( optionalHeader->DataDirectory[index].Size == 0 || optionalHeader->DataDirectory[index].VirtualAddress == 0 )
+        return FALSE;
+
+    if( size != NULL )
+        *size = optionalHeader->DataDirectory[index].Size;
+
+    *ptr = (void *)( (BYTE *) module + optionalHeader->DataDirectory[index].VirtualAddress );
+
+    return TRUE;
+}
+
+/* Map file read-only into memory. The view stays valid after the handles
+ * are closed and must be released by UnmapViewOfFile( ). Returns NULL and
+ * sets error on failure.
+ */
+static const void *map_file( const char *file, DWORD *size, DWORD *error )
+{
+    HANDLE hFile;
+    HANDLE hMapping;
+    const void *view;
+    DWORD dwSizeHigh;
+
+    view = NULL;
+    *error = 0;
+
+    hFile = CreateFileA( file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL );
+    if( hFile == INVALID_HANDLE_VALUE )
+    {
+        *error = GetLastError( );
+        return NULL;
+    }
+
+    /* PE images are limited to 4 GB */
+    *size = GetFileSize( hFile, &dwSizeHigh );
+    if( *size == INVALID_FILE_SIZE && GetLastError( ) != NO_ERROR )
+        *error = GetLastError( );
+    else if( dwSizeHigh != 0 || *size == 0 )
+        *error = ERROR_BAD_EXE_FORMAT;
+
+    if( *error == 0 )
+    {
+        hMapping = CreateFileMappingA( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+        if( hMapping != NULL )
+        {
+            view = MapViewOfFile( hMapping, FILE_MAP_READ, 0, 0, 0 );
+            if( view == NULL )
+                *error = GetLastError( );
+            CloseHandle( hMapping );
+        }
+        else
+            *error = GetLastError( );
+    }
+
+    CloseHandle( hFile );
+
+    return view;
+}
+
+/* Return symbol name for a given address from export table */
+static const char *get_export_symbol_name( HMODULE module, IMAGE_EXPORT_DIRECTORY *ied, const void *addr, void **func_address )
+{
+    DWORD i;
+    void *candidateAddr = NULL;
+    int candidateIndex = -1;
+    BYTE *base = (BYTE *) module;
+    DWORD *functionAddressesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfFunctions);
+    DWORD *functionNamesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfNames);
+    USHORT *functionNameOrdinalsIndexes = (USHORT *) (base + (DWORD) ied->AddressOfNameOrdinals);
+
+    for( i = 0; i < ied->NumberOfFunctions; i++ )
+    {
+        if( (void *) ( base + functionAddressesOffsets[i] ) > addr || candidateAddr >= (void *) ( base + functionAddressesOffsets[i] ) )
+            continue;
+
+        candidateAddr = (void *) ( base + functionAddressesOffsets[i] );
+        candidateIndex = i;
+    }
+
+    if( candidateIndex == -1 )
+        return NULL;
+
+    *func_address = candidateAddr;
+
+    for( i = 0; i < ied->NumberOfNames; i++ )
+    {
+        if( functionNameOrdinalsIndexes[i] == candidateIndex )
+            return (const char *) ( base + functionNamesOffsets[i] );
+    }
+
+    return NULL;
+}
+
+/* Get module data for a loaded module, drop data which belongs to a module
+ * previously loaded at the same address */
+static module_data *module_data_get( HMODULE module )
+{
+    IMAGE_NT_HEADERS *ntHeaders;
+    module_data *pdata;
+
+    ntHeaders = get_nt_headers( module );
+
+    if( ntHeaders == NULL )
+        return NULL;
+
+    pdata = module_data_add( module );
+
+    if( pdata == NULL )
+        return NULL;
+
+    /* HMODULE value may be reused by another module when the original one was
+     * unloaded without calling dlclose(), so drop stale data */
+    if( pdata->dwTimeDateStamp != ntHeaders->FileHeader.TimeDateStamp || pdata->dwSizeOfImage != ntHeaders->OptionalHeader.SizeOfImage )
+    {
+        module_data_clear( pdata );
+        pdata->dwTimeDateStamp = ntHeaders->FileHeader.TimeDateStamp;
+        pdata->dwSizeOfImage = ntHeaders->OptionalHeader.SizeOfImage;
+    }
+
+    return pdata;
+}
+
+/* Return symbol name for a given address from sorted export table */
+static const char *find_export_symbol_name( HMODULE module, module_data *pdata, const void *addr, void **func_address )
+{
+    DWORD rva;
+    DWORD low, high, middle;
+    BYTE *base = (BYTE *) module;
+
+    rva = (DWORD) ( (BYTE *) addr - base );
+
+    /* Binary search for the last entry with address less or equal to rva */
+    low = 0;
+    high = pdata->exports_count;
+    while( low < high )
+    {
+        middle = low + ( high - low ) / 2;
+        if( pdata->exports[middle].rva <= rva )
+            low = middle + 1;
+        else
+            high = middle;
+    }
+
+    if( low == 0 )
+        return NULL;
+
+    *func_address = (void *) ( base + pdata->exports[low-1].rva );
+
+    if( pdata->exports[low-1].name == 0 )
+        return NULL;
+
+    return (const char *) ( base + pdata->exports[low-1].name );
+}
+
+/* Point tables of module data into an export index, see expidx.h */
+static void module_data_set_tables( module_data *pdata, const void *index )
+{
+    const export_index_header *header = (const export_index_header *) index;
+
+    pdata->exports = (export_entry *) ( (const BYTE *) index + sizeof( export_index_header ) );
+    pdata->exports_count = header->exports_count;
+    pdata->names = (export_name_slot *) ( pdata->exports + header->exports_count );
+    pdata->names_size = header->names_size;
+}
+
+/* Build export table sorted by function address and hash table of export
+ * names of the module, the same way as an export index file is built.
+ */
+static BOOL build_export_tables( HMODULE module, module_data *pdata )
+{
+    IMAGE_NT_HEADERS *ntHeaders;
+    pe_image image;
+    unsigned char *data;
+    size_t size;
+
+    ntHeaders = get_nt_headers( module );
+
+    if( ntHeaders == NULL || !pe_image_init( &image, module, ntHeaders->OptionalHeader.SizeOfImage, 1 ) || !expidx_build( &image, &data, &size ) )
+        return FALSE;
+
+    module_data_set_tables( pdata, data );
+    pdata->index_data = data;
+
+    return TRUE;
+}
+
+/* Get module data with the export tables built. On success the state lock
+ * is held, shared when the tables were already built and exclusive otherwise,
+ * and it has to be released by module_data_release( ).
+ */
+static module_data *module_data_acquire( HMODULE module, BOOL *exclusive )
+{
+    IMAGE_NT_HEADERS *ntHeaders;
+    module_data *pdata;
+
+    ntHeaders = get_nt_headers( module );
+
+    if( ntHeaders == NULL )
+        return NULL;
+
+    lock_shared( );
+
+    pdata = module_data_search( module );
+
+    if( pdata != NULL &&
+        pdata->dwTimeDateStamp == ntHeaders->FileHeader.TimeDateStamp && pdata->dwSizeOfImage == ntHeaders->OptionalHeader.SizeOfImage &&
+        pdata->exports != NULL )
+    {
+        *exclusive = FALSE;
+        return pdata;
+    }
+
+    unlock_shared( );
+    lock_exclusive( );
+
+    pdata = module_data_get( module );
+
+    if( pdata != NULL && pdata->exports == NULL && !build_export_tables( module, pdata ) )
+        pdata = NULL;
+
+    if( pdata == NULL )
+    {
+        unlock_exclusive( );
+        return NULL;
+    }
+
+    *exclusive = TRUE;
+    return pdata;
+}
+
+static void module_data_release( BOOL exclusive )
+{
+    if( exclusive )
+        unlock_exclusive( );
+    else
+        unlock_shared( );
+}
+
+/* Find exported function in export directory of a loaded module. Name may be
+ * also an ordinal number as accepted by GetProcAddress(). Names are looked up
+ * in the hash table of pdata, see module_data_acquire( ).
+ * Return FALSE when the export table cannot be used, e.g. for forwarded
+ * exports, and the caller has to fall back to GetProcAddress().
+ */
+static BOOL find_export_in( HMODULE module, IMAGE_EXPORT_DIRECTORY *ied, DWORD iedSize, module_data *pdata, const char *name, FARPROC *symbol )
+{
+    DWORD index, rva, hash, slot;
+    BYTE *base = (BYTE *) module;
+    DWORD *functionAddressesOffsets;
+    DWORD *functionNamesOffsets;
+    USHORT *functionNameOrdinalsIndexes;
+
+    *symbol = NULL;
+
+    functionAddressesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfFunctions);
+
+    if( ( (ULONG_PTR) name >> 16 ) == 0 )
+    {
+        /* Import by ordinal, see MAKEINTRESOURCE() */
+        index = (DWORD) (ULONG_PTR) name - ied->Base;
+        if( (DWORD) (ULONG_PTR) name < ied->Base || index >= ied->NumberOfFunctions )
+            return TRUE;
+    }
+    else
+    {
+        functionNamesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfNames);
+        functionNameOrdinalsIndexes = (USHORT *) (base + (DWORD) ied->AddressOfNameOrdinals);
+
+        hash = expidx_hash_name( name );
+        for( slot = hash & ( pdata->names_size - 1 ); pdata->names[slot].index != 0; slot = ( slot + 1 ) & ( pdata->names_size - 1 ) )
+        {
+            if( pdata->names[slot].hash == hash && strcmp( (const char *) ( base + functionNamesOffsets[pdata->names[slot].index - 1] ), name ) == 0 )
+                break;
+        }
+
+        index = pdata->names[slot].index;
+
+        /* A mapped export index may still belong to another build of the
+         * module, see export_index_valid( ), so a name missing from it is
+         * left to GetProcAddress() */
+        if( index == 0 )
+            return pdata->index_view == NULL;
+
+        index = functionNameOrdinalsIndexes[index - 1];
+        if( index >= ied->NumberOfFunctions )
+            return FALSE;
+    }
+
+    rva = functionAddressesOffsets[index];
+
+    if( rva == 0 )
+        return TRUE;
+
+    /* Forwarded export points to a string inside the export directory, let
+     * GetProcAddress() load and resolve the target */
+    if( rva >= (DWORD) ( (BYTE *) ied - base ) && rva < (DWORD) ( (BYTE *) ied - base ) + iedSize )
+        return FALSE;
+
+    *symbol = (FARPROC) (LPVOID) ( base + rva );
+
+    return TRUE;
+}
+
+/* Find exported function of a loaded module without GetProcAddress(), see
+ * find_export_in().
+ */
+static BOOL find_export( HMODULE module, const char *name, FARPROC *symbol )
+{
+    IMAGE_EXPORT_DIRECTORY *ied;
+    DWORD iedSize;
+    module_data *pdata;
+    BOOL exclusive;
+    BOOL ret;
+
+    *symbol = NULL;
+
+    if( !get_image_section( module, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, &iedSize ) )
+        return FALSE;
+
+    if( ( (ULONG_PTR) name >> 16 ) == 0 )
+        return find_export_in( module, ied, iedSize, NULL, name, symbol );
+
+    pdata = module_data_acquire( module, &exclusive );
+
+    if( pdata == NULL )
+        return FALSE;
+
+    ret = find_export_in( module, ied, iedSize, pdata, name, symbol );
+
+    module_data_release( exclusive );
+
+    return ret;
+}
+
+/* Check that export index belongs to the module and its tables can be used
+ * by find_export_in( ) and find_export_symbol_name( ) without further checks.
+ * CheckSum is zero unless the linker sets it and reproducible builds fix
+ * TimeDateStamp, so the header does not tell apart all builds of a module
+ * and both tables are compared with its export directory. Unlike building
+ * the tables this needs neither sorting nor memory.
+ */
+static BOOL export_index_valid( HMODULE module, const BYTE *view, DWORD size )
+{
+    const export_index_header *header = (const export_index_header *) view;
+    const export_entry *exports;
+    const export_name_slot *names;
+    IMAGE_NT_HEADERS *ntHeaders;
+    IMAGE_EXPORT_DIRECTORY *ied;
+    BYTE *base = (BYTE *) module;
+    DWORD *functionAddressesOffsets;
+    DWORD *functionNamesOffsets;
+    USHORT *functionNameOrdinalsIndexes;
+    DWORD iedRva, iedSize;
+    DWORD i, names_size, used, slot, hash;
+
+    ntHeaders = get_nt_headers( module );
+
+    if( ntHeaders == NULL || !get_image_section( module, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, &iedSize ) )
+        return FALSE;
+
+    if( size < sizeof( export_index_header ) || memcmp( header->magic, EXPIDX_MAGIC, 4 ) != 0 || header->version != EXPIDX_VERSION )
+        return FALSE;
+
+    if( header->timestamp != ntHeaders->FileHeader.TimeDateStamp || header->checksum != ntHeaders->OptionalHeader.CheckSum || header->size_of_image != ntHeaders->OptionalHeader.SizeOfImage )
+        return FALSE;
+
+    /* Same size as chosen by expidx_build( ) */
+    if( ied->NumberOfFunctions > 0xffff || ied->NumberOfNames > ied->NumberOfFunctions )
+        return FALSE;
+    for( names_size = 16; names_size < 2 * ied->NumberOfNames; names_size *= 2 );
+
+    if( header->exports_count == 0 || header->exports_count > ied->NumberOfFunctions || header->names_size != names_size ||
+        size != sizeof( export_index_header ) + header->exports_count * sizeof( export_entry ) + names_size * sizeof( export_name_slot ) )
+        return FALSE;
+
+    functionAddressesOffsets = (DWORD *) ( base + (DWORD) ied->AddressOfFunctions );
+    functionNamesOffsets = (DWORD *) ( base + (DWORD) ied->AddressOfNames );
+    functionNameOrdinalsIndexes = (USHORT *) ( base + (DWORD) ied->AddressOfNameOrdinals );
+    iedRva = (DWORD) ( (BYTE *) ied - base );
+    exports = (const export_entry *) ( view + sizeof( export_index_header ) );
+    names = (const export_name_slot *) ( exports + header->exports_count );
+
+    /* Every name of the module has a slot holding its hash */
+    used = 0;
+    for( i = 0; i < names_size; i++ )
+    {
+        if( names[i].index > ied->NumberOfNames )
+            return FALSE;
+        if( names[i].index == 0 )
+            continue;
+        if( names[i].hash != expidx_hash_name( (const char *) ( base + functionNamesOffsets[names[i].index - 1] ) ) )
+            return FALSE;
+        used++;
+    }
+
+    if( used != ied->NumberOfNames )
+        return FALSE;
+
+    /* Every export is a function of the module and its name is one of the
+     * names of that function, found through its slot. The table is at most
+     * half full, so probing ends at an empty slot. */
+    for( i = 0; i < header->exports_count; i++ )
+    {
+        if( exports[i].index >= ied->NumberOfFunctions || exports[i].rva == 0 || exports[i].rva != functionAddressesOffsets[exports[i].index] ||
+            ( i != 0 && exports[i].rva <= exports[i-1].rva ) )
+            return FALSE;
+
+        if( exports[i].name == 0 )
+            continue;
+
+        if( exports[i].name < iedRva || exports[i].name >= iedRva + iedSize )
+            return FALSE;
+
+        hash = expidx_hash_name( (const char *) ( base + exports[i].name ) );
+        for( slot = hash & ( names_size - 1 ); names[slot].index != 0; slot = ( slot + 1 ) & ( names_size - 1 ) )
+        {
+            if( names[slot].hash == hash && functionNamesOffsets[names[slot].index - 1] == exports[i].name &&
+                functionNameOrdinalsIndexes[names[slot].index - 1] == exports[i].index )
+                break;
+        }
+
+        if( names[slot].index == 0 )
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* Map export index file <module path>.expidx when it exists and is valid */
+static const void *export_index_map( HMODULE module )
+{
+    char path[MAX_PATH + sizeof( EXPIDX_SUFFIX )];
+    const void *view;
+    DWORD dwSize;
+    DWORD dwError;
+    DWORD len;
+
+    len = GetModuleFileNameA( module, path, MAX_PATH );
+    if( len == 0 || len >= MAX_PATH )
+        return NULL;
+
+    memcpy( path + len, EXPIDX_SUFFIX, sizeof( EXPIDX_SUFFIX ) );
+
+    view = map_file( path, &dwSize, &dwError );
+    if( view == NULL )
+        return NULL;
+
+    if( !export_index_valid( module, (const BYTE *) view, dwSize ) )
+    {
+        UnmapViewOfFile( view );
+        return NULL;
+    }
+
+    return view;
+}
+
+/* Use tables of the mapped export index for the module, unless they were
+ * already built. The state lock must be held exclusively. The view is set to
+ * NULL when it was taken over.
+ */
+static void module_data_use_index( HMODULE module, const void **view )
+{
+    module_data *pdata;
+
+    pdata = module_data_get( module );
+
+    if( pdata == NULL || pdata->exports != NULL || pdata->names != NULL || pdata->index_view != NULL )
+        return;
+
+    module_data_set_tables( pdata, *view );
+    pdata->index_view = *view;
+    *view = NULL;
+}
+
+/* Incremented whenever the set of loaded modules or their RTLD_LOCAL state
+ * may have changed. Results of global symbol lookups are valid only for the
+ * generation in which they were computed.
+ */
+static volatile LONG module_generation;
+
+/* Reference counted list of loaded modules in load order. A list is never
+ * modified after it has been published, changes create a new list.
+ */
+/* Address range [base, end) occupied by the image of a module */
+typedef struct module_range {
+    ULONG_PTR base;
+    ULONG_PTR end;
+} module_range;
+
+typedef struct module_list {
+    LONG refs;
+    DWORD count;
+    /* Ranges of the modules sorted by base address, stored after modules */
+    module_range *ranges;
+    HMODULE modules[1];
+} module_list;
+
+/* Snapshot of loaded modules kept up to date by loader notifications or NULL
+ * when it has to be built first. Protected by loaded_modules_lock.
+ */
+static module_list *loaded_modules;
+static CRITICAL_SECTION loaded_modules_lock;
+
+static module_list *module_list_alloc( DWORD count )
+{
+    module_list *list;
+
+    list = (module_list *) malloc( sizeof( module_list ) + ( count ? count - 1 : 0 ) * sizeof( HMODULE ) + count * sizeof( module_range ) );
+
+    if( !list )
+    {
+        SetLastError( ERROR_NOT_ENOUGH_MEMORY );
+        return NULL;
+    }
+
+    list->refs = 1;
+    list->count = count;
+    list->ranges = (module_range *) &list->modules[count];
+
+    return list;
+}
+
+static int __cdecl compare_module_ranges( const void *a, const void *b )
+{
+    const module_range *ra = (const module_range *) a;
+    const module_range *rb = (const module_range *) b;
+
+    return ra->base < rb->base ? -1 : ra->base > rb->base ? 1 : 0;
+}
+
+/* Find module which contains the address, binary search in sorted ranges */
+static HMODULE module_list_find( const module_list *list, const void *addr )
+{
+    DWORD lo, hi, mid;
+
+    lo = 0;
+    hi = list->count;
+
+    /* Find first range with base above the address */
+    while( lo < hi )
+    {
+        mid = lo + ( hi - lo ) / 2;
+        if( list->ranges[mid].base <= (ULONG_PTR) addr )
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if( lo == 0 || (ULONG_PTR) addr >= list->ranges[lo - 1].end )
+        return NULL;
+
+    return (HMODULE) list->ranges[lo - 1].base;
+}
+
+/* Create list of loaded modules via EnumProcessModules() */
+static module_list *module_list_enumerate( void )
+{
+    HANDLE hCurrentProc;
+    IMAGE_NT_HEADERS *ntHeaders;
+    module_list *list;
+    DWORD cbNeeded;
+    DWORD dwSize;
+    DWORD i;
+
+    hCurrentProc = GetCurrentProcess( );
+
+    /* GetModuleHandle( NULL ) only returns the current program file. So
+     * if we want to get ALL loaded module including those in linked DLLs,
+     * we have to use EnumProcessModules( ).
+     */
+    if( MyEnumProcessModules( hCurrentProc, NULL, 0, &dwSize ) == 0 )
+        return NULL;
+
+    list = module_list_alloc( dwSize / sizeof( HMODULE ) );
+
+    if( !list )
+        return NULL;
+
+    if( MyEnumProcessModules( hCurrentProc, list->modules, dwSize, &cbNeeded ) == 0 || dwSize != cbNeeded )
+    {
+        free( list );
+        SetLastError( ERROR_INVALID_HANDLE );
+        return NULL;
+    }
+
+    for( i = 0; i < list->count; i++ )
+    {
+        ntHeaders = get_nt_headers( list->modules[i] );
+        list->ranges[i].base = (ULONG_PTR) list->modules[i];
+        list->ranges[i].end = (ULONG_PTR) list->modules[i] + ( ntHeaders != NULL ? ntHeaders->OptionalHeader.SizeOfImage : 0 );
+    }
+
+    qsort( list->ranges, list->count, sizeof( module_range ), compare_module_ranges );
+
+    return list;
+}
+
+/* Create copy of the list with the module appended or removed */
+static module_list *module_list_update( const module_list *list, HMODULE hModule, ULONG size, BOOL loaded )
+{
+    module_list *newlist;
+    DWORD i, j;
+
+    newlist = module_list_alloc( list->count + 1 );
+
+    if( !newlist )
+        return NULL;
+
+    for( i = 0, j = 0; i < list->count; i++ )
+        if( list->modules[i] != hModule )
+            newlist->modules[j++] = list->modules[i];
+
+    if( loaded )
+        newlist->modules[j++] = hModule;
+
+    /* Ranges stay sorted, the module is inserted at its place */
+    for( i = 0, j = 0; i < list->count; i++ )
+    {
+        if( list->ranges[i].base == (ULONG_PTR) hModule )
+            continue;
+        if( loaded && list->ranges[i].base > (ULONG_PTR) hModule && ( j == 0 || newlist->ranges[j-1].base < (ULONG_PTR) hModule ) )
+        {
+            newlist->ranges[j].base = (ULONG_PTR) hModule;
+            newlist->ranges[j++].end = (ULONG_PTR) hModule + size;
+        }
+        newlist->ranges[j++] = list->ranges[i];
+    }
+    if( loaded && ( j == 0 || newlist->ranges[j-1].base < (ULONG_PTR) hModule ) )
+    {
+        newlist->ranges[j].base = (ULONG_PTR) hModule;
+        newlist->ranges[j++].end = (ULONG_PTR) hModule + size;
+    }
+
+    newlist->count = j;
+
+    return newlist;
+}
+
+static void module_list_unref( module_list *list )
+{
+    if( --list->refs == 0 )
+        free( list );
+}
+
+/* LDR_DLL_NOTIFICATION_DATA from the DDK, loaded and unloaded notifications
+ * use the same layout. */
+typedef struct dll_notification_data {
+    ULONG Flags;
+    const void *FullDllName;
+    const void *BaseDllName;
+    PVOID DllBase;
+    ULONG SizeOfImage;
+} dll_notification_data;
+
+#define LDR_DLL_NOTIFICATION_REASON_LOADED   1
+#define LDR_DLL_NOTIFICATION_REASON_UNLOADED 2
+
+static VOID CALLBACK dll_notification( ULONG NotificationReason, const dll_notification_data *NotificationData, PVOID Context )
+{
+    module_list *list;
+
+    (void) Context;
+
+    /* Called with loader lock held, so do not call any loader function.
+     * Notifications are serialized by the loader lock.
+     */
+    EnterCriticalSection( &loaded_modules_lock );
+
+    InterlockedIncrement( &module_generation );
+
+    if( loaded_modules != NULL && ( NotificationReason == LDR_DLL_NOTIFICATION_REASON_LOADED || NotificationReason == LDR_DLL_NOTIFICATION_REASON_UNLOADED ) )
+    {
+        list = module_list_update( loaded_modules, (HMODULE) NotificationData->DllBase, NotificationData->SizeOfImage, NotificationReason == LDR_DLL_NOTIFICATION_REASON_LOADED );
+
+        /* On allocation failure drop the snapshot, next use enumerates again */
+        module_list_unref( loaded_modules );
+        loaded_modules = list;
+    }
+
+    LeaveCriticalSection( &loaded_modules_lock );
+}
+
+static LONG (NTAPI *LdrUnregisterDllNotificationPtr)(PVOID) = NULL;
+static PVOID dll_notification_cookie = NULL;
+
+static void unregister_dll_notification( void )
+{
+    if( LdrUnregisterDllNotificationPtr != NULL && dll_notification_cookie != NULL )
+        LdrUnregisterDllNotificationPtr( dll_notification_cookie );
+    dll_notification_cookie = NULL;
+}
+
+/* Register for loader notifications about modules loaded or unloaded by any
+ * code in the process. These notifications are available since Windows
+ * Vista. Without them there is no cheap way to detect modules loaded via
+ * LoadLibrary(), so the module list has to be enumerated on every use and
+ * results of global lookups cannot be cached. Called once by global_init( ).
+ */
+static BOOL register_dll_notification( void )
+{
+    LONG (NTAPI *LdrRegisterDllNotificationPtr)(ULONG, PVOID, PVOID, PVOID *) = NULL;
+    HMODULE ntdll;
+
+    ntdll = GetModuleHandleA( "ntdll.dll" );
+    if( ntdll != NULL )
+    {
+        LdrRegisterDllNotificationPtr = (LONG (NTAPI *)(ULONG, PVOID, PVOID, PVOID *)) (LPVOID) GetProcAddress( ntdll, "LdrRegisterDllNotification" );
+        LdrUnregisterDllNotificationPtr = (LONG (NTAPI *)(PVOID)) (LPVOID) GetProcAddress( ntdll, "LdrUnregisterDllNotification" );
+    }
+
+    if( LdrRegisterDllNotificationPtr == NULL || LdrUnregisterDllNotificationPtr == NULL ||
+        LdrRegisterDllNotificationPtr( 0, (PVOID) dll_notification, NULL, &dll_notification_cookie ) != 0 )
+    {
+        dll_notification_cookie = NULL;
+        return FALSE;
+    }
+
+    /* Callback must not stay registered after this code is unloaded, which
+     * happens when the static library is linked into a DLL */
+    atexit( unregister_dll_notification );
+
+    return TRUE;
+}
+
+/* Get list of loaded modules in load order, which must be released by
+ * module_list_release(). Return NULL and set last error on failure.
+ */
+static module_list *module_list_acquire( void )
+{
+    module_list *list;
+    LONG generation;
+    int tries;
+
+    if( dll_notification_cookie == NULL )
+        return module_list_enumerate( );
+
+    EnterCriticalSection( &loaded_modules_lock );
+    list = loaded_modules;
+    if( list != NULL )
+        list->refs++;
+    LeaveCriticalSection( &loaded_modules_lock );
+
+    if( list != NULL )
+        return list;
+
+    /* Build the snapshot. It can be published only when no notification
+     * arrived during enumeration, otherwise it could miss some change.
+     */
+    for( tries = 0; ; tries++ )
+    {
+        generation = module_generation;
+        list = module_list_enumerate( );
+
+        if( list == NULL )
+            return NULL;
+
+        EnterCriticalSection( &loaded_modules_lock );
+        if( loaded_modules == NULL && generation == module_generation )
+        {
+            list->refs++;
+            loaded_modules = list;
+            LeaveCriticalSection( &loaded_modules_lock );
+            return list;
+        }
+        LeaveCriticalSection( &loaded_modules_lock );
+
+        /* Modules are changing too often, use private copy this time */
+        if( tries >= 2 )
+            return list;
+
+        free( list );
+    }
+}
+
+static void module_list_release( module_list *list )
+{
+    if( dll_notification_cookie == NULL )
+    {
+        module_list_unref( list );
+        return;
+    }
+
+    EnterCriticalSection( &loaded_modules_lock );
+    module_list_unref( list );
+    LeaveCriticalSection( &loaded_modules_lock );
+}
+
+
+/* Cached result of a lookup in the global scope */
+typedef struct global_symbol {
+    char *name;         /* NULL for empty slot */
+    DWORD hash;
+    FARPROC symbol;     /* NULL for symbol which was not found */
+} global_symbol;
+
+/* Maximal number of slots, the cache is emptied when it is half full */
+#define GLOBAL_CACHE_MAX_SIZE 8192
+
+static global_symbol *global_cache;
+static DWORD global_cache_size;
+static DWORD global_cache_count;
+static LONG global_cache_generation;
+
+static void global_cache_clear( void )
+{
+    DWORD i;
+
+    for( i = 0; i < global_cache_size; i++ )
+    {
+        free( global_cache[i].name );
+        global_cache[i].name = NULL;
+    }
+
+    global_cache_count = 0;
+}
+
+/* Look up cached result, return FALSE when the name is not cached */
+static BOOL global_cache_search( const char *name, LONG generation, FARPROC *symbol )
+{
+    DWORD hash, slot;
+    BOOL found = FALSE;
+
+    hash = expidx_hash_name( name );
+
+    lock_shared( );
+
+    if( global_cache_count != 0 && global_cache_generation == generation )
+    {
+        for( slot = hash & ( global_cache_size - 1 ); global_cache[slot].name != NULL; slot = ( slot + 1 ) & ( global_cache_size - 1 ) )
+        {
+            if( global_cache[slot].hash == hash && strcmp( global_cache[slot].name, name ) == 0 )
+            {
+                *symbol = global_cache[slot].symbol;
+                found = TRUE;
+                break;
+            }
+        }
+    }
+
+    unlock_shared( );
+
+    return found;
+}
+
+static void global_cache_insert( global_symbol *cache, DWORD size, char *name, DWORD hash, FARPROC symbol )
+{
+    DWORD slot;
+
+    for( slot = hash & ( size - 1 ); cache[slot].name != NULL; slot = ( slot + 1 ) & ( size - 1 ) );
+
+    cache[slot].name = name;
+    cache[slot].hash = hash;
+    cache[slot].symbol = symbol;
+}
+
+/* Take ownership of the name and store it, must be called with the state
+ * lock held exclusively. Return FALSE when the name was not stored. */
+static BOOL global_cache_add_locked( char *name, LONG generation, FARPROC symbol )
+{
+    global_symbol *cache;
+    DWORD i, size, hash, slot;
+
+    /* Some module was loaded or unloaded during the lookup */
+    if( generation != module_generation )
+        return FALSE;
+
+    hash = expidx_hash_name( name );
+
+    if( global_cache_generation != generation )
+    {
+        global_cache_clear( );
+        global_cache_generation = generation;
+    }
+
+    /* Another thread could have stored the same name meanwhile */
+    if( global_cache_count != 0 )
+    {
+        for( slot = hash & ( global_cache_size - 1 ); global_cache[slot].name != NULL; slot = ( slot + 1 ) & ( global_cache_size - 1 ) )
+            if( global_cache[slot].hash == hash && strcmp( global_cache[slot].name, name ) == 0 )
+                return FALSE;
+    }
+
+    if( 2 * ( global_cache_count + 1 ) > global_cache_size )
+    {
+        if( global_cache_size >= GLOBAL_CACHE_MAX_SIZE )
+        {
+            global_cache_clear( );
+        }
+        else
+        {
+            size = global_cache_size ? 2 * global_cache_size : 64;
+            cache = (global_symbol *) calloc( size, sizeof( global_symbol ) );
+
+            if( !cache )
+                return FALSE;
+
+            for( i = 0; i < global_cache_size; i++ )
+                if( global_cache[i].name != NULL )
+                    global_cache_insert( cache, size, global_cache[i].name, global_cache[i].hash, global_cache[i].symbol );
+
+            free( global_cache );
+            global_cache = cache;
+            global_cache_size = size;
+        }
+    }
+
+    global_cache_insert( global_cache, global_cache_size, name, hash, symbol );
+    global_cache_count++;
+
+    return TRUE;
+}
+
+/* Store result of a lookup started in the given generation */
+static void global_cache_add( const char *name, LONG generation, FARPROC symbol )
+{
+    size_t len;
+    char *copy;
+
+    len = strlen( name ) + 1;
+    copy = (char *) malloc( len );
+
+    if( !copy )
+        return;
+
+    memcpy( copy, name, len );
+
+    lock_exclusive( );
+    if( !global_cache_add_locked( copy, generation, symbol ) )
+        free( copy );
+    unlock_exclusive( );
+}
+
+/* Path passed to dlopen() and the module it returned. Entries are kept while
+ * the module is open, so that opening the same path again needs neither
+ * LoadLibraryEx( ) nor enumeration of the modules.
+ */
+typedef struct path_entry {
+    char *path;
+    DWORD hash;
+    HMODULE hModule;
+    struct path_entry *next;
+} path_entry;
+
+#define PATH_CACHE_BUCKETS 256
+
+static path_entry *path_cache[PATH_CACHE_BUCKETS];
+
+/* Make the key of the path cache. Relative paths with a directory depend on
+ * the current directory, so they are made absolute. Bare names are kept, the
+ * loader returns an already loaded module of the same name for them anyway.
+ * Case is not folded, as bytes of letters can be trail bytes of DBCS code
+ * pages. Another case of a name only misses the cache.
+ */
+static BOOL path_cache_key( const char *file, char *key, DWORD size )
+{
+    size_t len;
+
+    if( strchr( file, '\\' ) != NULL || strchr( file, ':' ) != NULL )
+    {
+        len = GetFullPathNameA( file, size, key, NULL );
+        return len != 0 && len < size;
+    }
+
+    len = strlen( file );
+
+    if( len >= size )
+        return FALSE;
+
+    memcpy( key, file, len + 1 );
+
+    return TRUE;
+}
+
+/* Allocate entry holding a copy of the key, the path is stored after it */
+static path_entry *path_entry_new( const char *key, DWORD hash, HMODULE hModule )
+{
+    path_entry *entry;
+    size_t len;
+
+    len = strlen( key ) + 1;
+    entry = (path_entry *) malloc( sizeof( path_entry ) + len );
+
+    if( !entry )
+        return NULL;
+
+    entry->path = (char *) ( entry + 1 );
+    memcpy( entry->path, key, len );
+    entry->hash = hash;
+    entry->hModule = hModule;
+    entry->next = NULL;
+
+    return entry;
+}
+
+/* These functions must be called with the state lock held, exclusively when
+ * the cache is modified.
+ */
+static HMODULE path_cache_search( const char *key, DWORD hash )
+{
+    path_entry *entry;
+
+    for( entry = path_cache[hash % PATH_CACHE_BUCKETS]; entry; entry = entry->next )
+        if( entry->hash == hash && strcmp( entry->path, key ) == 0 )
+            return entry->hModule;
+
+    return NULL;
+}
+
+/* Take ownership of the entry, return FALSE when the path is already stored */
+static BOOL path_cache_add( path_entry *entry )
+{
+    size_t bucket;
+
+    if( path_cache_search( entry->path, entry->hash ) != NULL )
+        return FALSE;
+
+    bucket = entry->hash % PATH_CACHE_BUCKETS;
+    entry->next = path_cache[bucket];
+    path_cache[bucket] = entry;
+
+    return TRUE;
+}
+
+/* Forget all paths of the module, a module can be opened by several paths */
+static void path_cache_rem( HMODULE hModule )
+{
+    path_entry **pentry;
+    path_entry *entry;
+    size_t i;
+
+    for( i = 0; i < PATH_CACHE_BUCKETS; i++ )
+    {
+        pentry = &path_cache[i];
+
+        while( *pentry != NULL )
+        {
+            entry = *pentry;
+
+            if( entry->hModule == hModule )
+            {
+                *pentry = entry->next;
+                free( entry );
+            }
+            else
+                pentry = &entry->next;
+        }
+    }
+}
+
+/* Modules whose last dlclose() was deferred, each holding the loader
+ * reference which the library kept for it. Protected by the state lock.
+ */
+static HMODULE *close_queue;
+static DWORD close_queue_count;
+static DWORD close_queue_size;
+
+/* Modules being unloaded by close_flush( ), protected by the state lock */
+static const HMODULE *close_flushing;
+static DWORD close_flushing_count;
+
+/* One of DLFCN_WIN32_CLOSE_*, changed with the state lock held exclusively */
+static volatile LONG close_mode = DLFCN_WIN32_CLOSE_NOW;
+
+/* close_mode_lock serializes dlfcn_win32_set_close_mode( ) calls and
+ * close_flush_lock the flushes. The background thread waits for
+ * close_event, which is set when modules are queued or the mode changes.
+ */
+static CRITICAL_SECTION close_mode_lock;
+static CRITICAL_SECTION close_flush_lock;
+static HANDLE close_event;
+static HANDLE close_thread;
+
+/* These functions must be called with the state lock held exclusively. */
+
+/* Return FALSE when the queue cannot grow */
+static BOOL close_queue_add( HMODULE hModule )
+{
+    HMODULE *queue;
+    DWORD size;
+
+    if( close_queue_count == close_queue_size )
+    {
+        size = close_queue_size ? 2 * close_queue_size : 16;
+        queue = (HMODULE *) realloc( close_queue, size * sizeof( HMODULE ) );
+
+        if( !queue )
+            return FALSE;
+
+        close_queue = queue;
+        close_queue_size = size;
+    }
+
+    close_queue[close_queue_count++] = hModule;
+
+    return TRUE;
+}
+
+/* Take back the queued close of a module which is opened again, its loader
+ * reference goes to the caller. Return FALSE when it is not queued. */
+static BOOL close_queue_rem( HMODULE hModule )
+{
+    DWORD i;
+
+    for( i = 0; i < close_queue_count; i++ )
+    {
+        if( close_queue[i] == hModule )
+        {
+            close_queue[i] = close_queue[--close_queue_count];
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static BOOL close_queue_is_flushing( HMODULE hModule )
+{
+    DWORD i;
+
+    for( i = 0; i < close_flushing_count; i++ )
+        if( close_flushing[i] == hModule )
+            return TRUE;
+
+    return FALSE;
+}
+
+/* Handle returned by dlopen() with RTLD_DEFER_LOAD. Its module is loaded by
+ * the first dlsym() of the handle.
+ */
+typedef struct lazy_handle {
+    int mode;                   /* Mode of dlopen() without RTLD_DEFER_LOAD */
+    HMODULE hModule;            /* NULL until the module is loaded */
+    struct lazy_handle *next;
+    char file[1];               /* File passed to dlopen() */
+} lazy_handle;
+
+/* Lazy handles are heap blocks, aligned to at least 8 bytes */
+#define LAZY_HANDLE_BUCKETS 64
+#define LAZY_HANDLE_HASH( handle ) ( ( (ULONG_PTR) (handle) >> 3 ) % LAZY_HANDLE_BUCKETS )
+
+/* Hash table of lazy handles protected by the state lock. Other handles are
+ * not looked up there while lazy_handle_count is zero. */
+static lazy_handle *lazy_handles[LAZY_HANDLE_BUCKETS];
+static volatile LONG lazy_handle_count;
+
+/* Check without loading that the loader finds the file. Paths are checked
+ * directly, names are looked up among loaded modules and in the search path.
+ * Returns FALSE and sets the last error when the file does not exist.
+ */
+static BOOL lazy_file_exists( const char *file )
+{
+    char lpFileName[MAX_PATH + 4];
+    const char *name;
+    DWORD dwAttributes;
+    size_t i, len;
+
+    /* MSDN says backslashes *must* be used instead of forward slashes. */
+    len = strlen( file );
+    for( i = 0; i <= len; i++ )
+        lpFileName[i] = file[i] == '/' ? '\\' : file[i];
+
+    if( strchr( lpFileName, '\\' ) == NULL && strchr( lpFileName, ':' ) == NULL )
+    {
+        if( GetModuleHandleA( lpFileName ) != NULL )
+            return TRUE;
+
+        return SearchPathA( NULL, lpFileName, ".dll", 0, NULL, NULL ) != 0;
+    }
+
+    dwAttributes = GetFileAttributesA( lpFileName );
+
+    /* LoadLibrary( ) appends .dll to a file name without extension */
+    name = strrchr( lpFileName, '\\' );
+    if( dwAttributes == INVALID_FILE_ATTRIBUTES && strchr( name != NULL ? name : lpFileName, '.' ) == NULL )
+    {
+        memcpy( lpFileName + len, ".dll", sizeof( ".dll" ) );
+        dwAttributes = GetFileAttributesA( lpFileName );
+    }
+
+    if( dwAttributes == INVALID_FILE_ATTRIBUTES )
+        return FALSE;
+
+    if( dwAttributes & FILE_ATTRIBUTE_DIRECTORY )
+    {
+        SetLastError( ERROR_MOD_NOT_FOUND );
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static lazy_handle *lazy_handle_new( const char *file, int mode )
+{
+    lazy_handle *lazy;
+    size_t len;
+    size_t bucket;
+
+    len = strlen( file );
+    lazy = (lazy_handle *) malloc( sizeof( lazy_handle ) + len );
+
+    if( !lazy )
+        return NULL;
+
+    memcpy( lazy->file, file, len + 1 );
+    lazy->mode = mode;
+    lazy->hModule = NULL;
+
+    bucket = LAZY_HANDLE_HASH( lazy );
+
+    lock_exclusive( );
+    lazy->next = lazy_handles[bucket];
+    lazy_handles[bucket] = lazy;
+    InterlockedIncrement( &lazy_handle_count );
+    unlock_exclusive( );
+
+    return lazy;
+}
+
+/* Must be called with the state lock held */
+static lazy_handle *lazy_handle_search( const void *handle )
+{
+    lazy_handle *lazy;
+
+    for( lazy = lazy_handles[LAZY_HANDLE_HASH( handle )]; lazy; lazy = lazy->next )
+        if( lazy == handle )
+            return lazy;
+
+    return NULL;
+}
+
+/* Remove the handle from the table, return NULL when it is not lazy */
+static lazy_handle *lazy_handle_take( const void *handle )
+{
+    lazy_handle **plazy;
+    lazy_handle *lazy;
+
+    if( lazy_handle_count == 0 )
+        return NULL;
+
+    lazy = NULL;
+
+    lock_exclusive( );
+
+    for( plazy = &lazy_handles[LAZY_HANDLE_HASH( handle )]; *plazy; plazy = &(*plazy)->next )
+    {
+        if( *plazy == handle )
+        {
+            lazy = *plazy;
+            *plazy = lazy->next;
+            InterlockedDecrement( &lazy_handle_count );
+            break;
+        }
+    }
+
+    unlock_exclusive( );
+
+    return lazy;
+}
+
+/* 0 = not initialized, 1 = initialization in progress, 2 = initialized */
+static volatile LONG init_state = 0;
+
+/* Initialize locks and loader notifications on first use. Static
+ * initialization is not possible for a CRITICAL_SECTION and DllMain( ) is
+ * not available in the static library.
+ */
+static void global_init( void )
+{
+    if( init_state == 2 )
+    {
+        DLFCN_ACQUIRE_BARRIER( );
+        return;
+    }
+
+    if( InterlockedCompareExchange( &init_state, 1, 0 ) == 0 )
+    {
+        lock_init( );
+        thread_init( );
+        InitializeCriticalSection( &loaded_modules_lock );
+        InitializeCriticalSection( &close_mode_lock );
+        InitializeCriticalSection( &close_flush_lock );
+        register_dll_notification( );
+        InterlockedExchange( &init_state, 2 );
+        return;
+    }
+
+    /* Another thread is initializing */
+    while( init_state != 2 )
+        Sleep( 0 );
+    DLFCN_ACQUIRE_BARRIER( );
+}
+
+/* Set by dlfcn_win32_set_trace_callback( ). Public functions read it once
+ * and take timestamps only when it is set, so disabled tracing costs a test
+ * of this pointer.
+ */
+static dlfcn_win32_trace_callback volatile trace_callback = NULL;
+
+/* Report finished call to the trace callback */
+static void trace_call( dlfcn_win32_trace_callback callback, int function, ULONGLONG start, const char *name, void *handle, const void *addr, int success )
+{
+    dlfcn_win32_trace_event event;
+
+    event.function = function;
+    event.success = success;
+    event.thread_id = GetCurrentThreadId( );
+    event.start_ns = stats_ticks_to_ns( start );
+    event.end_ns = stats_ticks_to_ns( stats_ticks( ) );
+    /* dlsym( ) accepts an ordinal in place of the name, see MAKEINTRESOURCE() */
+    if( ( (ULONG_PTR) name >> 16 ) == 0 )
+    {
+        event.name = NULL;
+        event.ordinal = (unsigned int) (ULONG_PTR) name;
+    }
+    else
+    {
+        event.name = name;
+        event.ordinal = 0;
+    }
+    event.handle = handle;
+    event.addr = addr;
+
+    callback( &event );
+}
+
+/* IMAGE_DELAYLOAD_DESCRIPTOR, which older SDKs do not declare */
+typedef struct delay_import_descriptor {
+    DWORD Attributes;
+    DWORD DllNameRVA;
+    DWORD ModuleHandleRVA;
+    DWORD ImportAddressTableRVA;
+    DWORD ImportNameTableRVA;
+    DWORD BoundImportAddressTableRVA;
+    DWORD UnloadInformationTableRVA;
+    DWORD TimeDateStamp;
+} delay_import_descriptor;
+
+/* Addresses in the descriptor are RVAs, old descriptors hold VAs instead */
+#define DELAY_IMPORT_RVA 1
+
+/* Do what the delay-load helper does on the first call of each delay-loaded
+ * import: load the dll, store its handle and write the addresses into the
+ * import address table. Imports which cannot be bound are left to the
+ * helper, which reports them when they are called.
+ */
+static void bind_delay_imports( HMODULE hModule )
+{
+    static LONG (NTAPI *LdrLockLoaderLockPtr)(ULONG, ULONG *, PVOID *) = NULL;
+    static LONG (NTAPI *LdrUnlockLoaderLockPtr)(ULONG, PVOID) = NULL;
+    delay_import_descriptor *did;
+    ULONG_PTR *names;
+    FARPROC *symbols;
+    FARPROC *iat;
+    HMODULE *phDll;
+    HMODULE ntdll;
+    HMODULE hDll;
+    DWORD count, i;
+    DWORD dwOldProtect;
+    PVOID cookie;
+
+    if( !get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_DELAY_IMPORT, (void **) &did, NULL ) )
+        return;
+
+    if( LdrLockLoaderLockPtr == NULL || LdrUnlockLoaderLockPtr == NULL )
+    {
+        ntdll = GetModuleHandleA( "ntdll.dll" );
+        if( ntdll != NULL )
+        {
+            LdrLockLoaderLockPtr = (LONG (NTAPI *)(ULONG, ULONG *, PVOID *)) (LPVOID) GetProcAddress( ntdll, "LdrLockLoaderLock" );
+            LdrUnlockLoaderLockPtr = (LONG (NTAPI *)(ULONG, PVOID)) (LPVOID) GetProcAddress( ntdll, "LdrUnlockLoaderLock" );
+        }
+
+        /* Without the loader lock the imports are left to the helper */
+        if( LdrLockLoaderLockPtr == NULL || LdrUnlockLoaderLockPtr == NULL )
+            return;
+    }
+
+    for( ; did->DllNameRVA != 0; did++ )
+    {
+        if( !(did->Attributes & DELAY_IMPORT_RVA) || did->ModuleHandleRVA == 0 || did->ImportAddressTableRVA == 0 || did->ImportNameTableRVA == 0 )
+            continue;
+
+        phDll = (HMODULE *) ( (BYTE *) hModule + did->ModuleHandleRVA );
+        iat = (FARPROC *) ( (BYTE *) hModule + did->ImportAddressTableRVA );
+        names = (ULONG_PTR *) ( (BYTE *) hModule + did->ImportNameTableRVA );
+
+        /* The helper could have loaded the dll already, otherwise store the
+         * handle the same way as it does */
+        hDll = *phDll;
+        if( hDll == NULL )
+        {
+            hDll = LoadLibraryA( (const char *) hModule + did->DllNameRVA );
+            if( hDll == NULL )
+                continue;
+
+            if( InterlockedCompareExchangePointer( (PVOID volatile *) phDll, (PVOID) hDll, NULL ) != NULL )
+            {
+                FreeLibrary( hDll );
+                hDll = *phDll;
+            }
+        }
+
+        for( count = 0; names[count] != 0; count++ );
+
+        if( count == 0 )
+            continue;
+
+        symbols = (FARPROC *) malloc( count * sizeof( FARPROC ) );
+
+        if( !symbols )
+            continue;
+
+        for( i = 0; i < count; i++ )
+        {
+            if( IMAGE_SNAP_BY_ORDINAL( names[i] ) )
+                symbols[i] = GetProcAddress( hDll, (LPCSTR) (ULONG_PTR) IMAGE_ORDINAL( names[i] ) );
+            else
+                symbols[i] = GetProcAddress( hDll, ( (IMAGE_IMPORT_BY_NAME *) ( (BYTE *) hModule + names[i] ) )->Name );
+        }
+
+        /* Import address table can be in a read-only section. dlopen() on
+         * another thread and the delay-load helper may write the same table
+         * meanwhile, so its protection is changed, the addresses are written
+         * and the protection is restored under the loader lock.
+         */
+        if( LdrLockLoaderLockPtr( 0, NULL, &cookie ) == 0 )
+        {
+            if( VirtualProtect( iat, count * sizeof( FARPROC ), PAGE_READWRITE, &dwOldProtect ) )
+            {
+                for( i = 0; i < count; i++ )
+                {
+                    if( symbols[i] != NULL )
+                        iat[i] = symbols[i];
+                }
+
+                VirtualProtect( iat, count * sizeof( FARPROC ), dwOldProtect, &dwOldProtect );
+            }
+
+            LdrUnlockLoaderLockPtr( 0, cookie );
+        }
+
+        free( symbols );
+    }
+}
+
+/* Bind delay-loaded imports of the module once */
+static void module_data_bind_delay_imports( HMODULE hModule )
+{
+    module_data *pdata;
+    BOOL bound;
+
+    lock_shared( );
+    pdata = module_data_search( hModule );
+    bound = pdata != NULL && pdata->delay_bound;
+    unlock_shared( );
+
+    if( bound )
+        return;
+
+    /* Binding calls the loader, so it runs without the lock. Concurrent
+     * bindings write the same addresses. */
+    bind_delay_imports( hModule );
+
+    lock_exclusive( );
+    pdata = module_data_search( hModule );
+    if( pdata != NULL )
+        pdata->delay_bound = TRUE;
+    unlock_exclusive( );
+}
+
+/* Open the file, as dlopen() does with RTLD_NOW */
+static HMODULE dlopen_file( const char *file, int mode, dlfcn_win32_stats *stats )
+{
+    module_list *before;
+    char lpFileName[MAX_PATH];
+    char key[MAX_PATH];
+    module_data *pdata;
+    path_entry *entry;
+    const void *index;
+    ULONGLONG start;
+    HMODULE hModule;
+    size_t i, len;
+    DWORD hash;
+    BOOL cacheable, release, loaded, pin, ok;
+
+    len = strlen( file );
+
+    if( len >= sizeof( lpFileName ) )
+    {
+        save_err_str( file, ERROR_FILENAME_EXCED_RANGE );
+        hModule = NULL;
+    }
+    else
+    {
+        /* MSDN says backslashes *must* be used instead of forward slashes. */
+        for( i = 0; i < len; i++ )
+        {
+            if( file[i] == '/' )
+                lpFileName[i] = '\\';
+            else
+                lpFileName[i] = file[i];
+        }
+        lpFileName[len] = '\0';
+
+        /* A path which returned a module still open returns it again
+         * without asking the loader. This is what LoadLibraryEx( ) of an
+         * already loaded module would do, so RTLD_GLOBAL promotes a local
+         * module and RTLD_LOCAL changes nothing.
+         */
+        hModule = NULL;
+        cacheable = path_cache_key( lpFileName, key, sizeof( key ) );
+
+        if( cacheable )
+        {
+            hash = expidx_hash_name( key );
+
+            lock_exclusive( );
+
+            hModule = path_cache_search( key, hash );
+            pin = FALSE;
+
+            if( hModule != NULL )
+            {
+                pdata = module_data_open( hModule );
+
+                /* The open cannot be counted without module data, so the
+                 * loader has to add a reference as for a module not cached */
+                if( pdata == NULL )
+                    hModule = NULL;
+            }
+
+            if( hModule != NULL )
+            {
+                if( !(mode & RTLD_LOCAL) )
+                {
+                    local_rem( hModule );
+                    InterlockedIncrement( &module_generation );
+                }
+
+                if( (mode & RTLD_NODELETE) && !pdata->pinned )
+                    pdata->pinned = pin = TRUE;
             }
-            MySetErrorMode( uMode );
+
+            unlock_exclusive( );
+
+            if( pin )
+                MyPinModule( hModule );
         }
 
-        if( EnumProcessModulesPtr == NULL )
+        if( hModule != NULL )
         {
-            failed = TRUE;
-            return FALSE;
+            STATS_ADD( stats->dlopen_cache_hits, 1 );
+        }
+        else
+        {
+            if( mode & RTLD_NOLOAD )
+            {
+                /* The name is only looked up among loaded modules, so
+                 * no file is accessed and the module counts as already
+                 * loaded */
+                before = NULL;
+                hModule = MyGetModuleHandleRef( lpFileName );
+            }
+            else
+            {
+                /* With loader notifications this only references the
+                 * snapshot kept up to date by them, no enumeration */
+                before = module_list_acquire( );
+
+                /* POSIX says the search path is implementation-defined.
+                 * LOAD_WITH_ALTERED_SEARCH_PATH is used to make it behave more closely
+                 * to UNIX's search paths (start with system folders instead of current
+                 * folder).
+                 */
+                start = stats_ticks( );
+                hModule = LoadLibraryExA( lpFileName, NULL, LOAD_WITH_ALTERED_SEARCH_PATH );
+                STATS_ADD( stats->load_library_ns, stats_ticks( ) - start );
+            }
+
+            /* The module was loaded by this call if it was not in the
+             * snapshot. Unlike comparing numbers of modules, this is not
+             * confused by other threads loading or unloading modules
+             * meanwhile. Without a snapshot the module is considered
+             * already loaded.
+             */
+            loaded = hModule != NULL && before != NULL && module_list_find( before, hModule ) != hModule;
+
+            if( !hModule )
+                save_err_str( lpFileName, GetLastError( ) );
+
+            if( before != NULL )
+                module_list_release( before );
+
+            if( hModule != NULL )
+            {
+                /* Export index is looked for only when the module is
+                 * opened for the first time, mapping needs no lock.
+                 * RTLD_NOLOAD promises not to access files. */
+                index = NULL;
+                if( !(mode & RTLD_NOLOAD) && !module_data_is_open( hModule ) )
+                    index = export_index_map( hModule );
+
+                /* The path cache is only a cache, so allocation failure
+                 * is not fatal */
+                entry = NULL;
+                if( cacheable )
+                    entry = path_entry_new( key, hash, hModule );
+
+                /* If the object was loaded with RTLD_LOCAL, add it to list of local
+                 * objects, so that its symbols cannot be retrieved even if the handle for
+                 * the original program file is passed. POSIX says that if the same
+                 * file is specified in multiple invocations, and any of them are
+                 * RTLD_GLOBAL, even if any further invocations use RTLD_LOCAL, the
+                 * symbols will remain global.
+                 */
+                ok = TRUE;
+                release = FALSE;
+                pin = FALSE;
+
+                lock_exclusive( );
+
+                /* Module whose unloading was deferred is still loaded,
+                 * but for the caller dlclose() unloaded it, so it counts
+                 * as newly loaded. Its queued loader reference is the
+                 * one the library keeps, the new one is released. */
+                if( close_queue_rem( hModule ) )
+                    loaded = release = TRUE;
+                else if( close_queue_is_flushing( hModule ) )
+                    loaded = TRUE;
+
+                if( (mode & RTLD_LOCAL) && loaded )
+                {
+                    ok = local_add( hModule );
+                }
+                else if( !(mode & RTLD_LOCAL) && !loaded )
+                {
+                    local_rem( hModule );
+                }
+
+                if( ok )
+                {
+                    /* Only the first dlopen() of a module keeps the reference
+                     * of the loader, dlclose() frees it with the last close.
+                     * When module data could not be allocated, every dlopen()
+                     * keeps its reference and nothing is cached.
+                     */
+                    pdata = module_data_open( hModule );
+
+                    if( pdata != NULL )
+                    {
+                        if( pdata->open_count > 1 || pdata->pinned )
+                            release = TRUE;
+
+                        if( entry != NULL && path_cache_add( entry ) )
+                            entry = NULL;
+                    }
+
+                    /* Module data keep the loader reference of a pinned
+                     * module, pinning by the loader covers the rest */
+                    if( (mode & RTLD_NODELETE) && ( pdata == NULL || !pdata->pinned ) )
+                    {
+                        if( pdata != NULL )
+                            pdata->pinned = TRUE;
+                        pin = TRUE;
+                    }
+
+                    if( index != NULL )
+                    {
+                        module_data_use_index( hModule, &index );
+                        if( index == NULL )
+                            STATS_ADD( stats->export_indexes_mapped, 1 );
+                    }
+                    InterlockedIncrement( &module_generation );
+                }
+
+                unlock_exclusive( );
+
+                free( entry );
+
+                if( index != NULL )
+                    UnmapViewOfFile( index );
+
+                if( pin )
+                    MyPinModule( hModule );
+
+                if( release )
+                    FreeLibrary( hModule );
+
+                if( !ok )
+                {
+                    save_err_str( lpFileName, ERROR_NOT_ENOUGH_MEMORY );
+                    FreeLibrary( hModule );
+                    hModule = NULL;
+                }
+            }
         }
     }
 
-    return EnumProcessModulesPtr( hProcess, lphModule, cb, lpcbNeeded );
+    /* After the bookkeeping, so that module data record the binding */
+    if( hModule != NULL && (mode & RTLD_BIND_DELAY_IMPORTS) )
+        module_data_bind_delay_imports( hModule );
+
+    return hModule;
 }
 
 DLFCN_EXPORT
 void *dlopen( const char *file, int mode )
 {
+    dlfcn_win32_trace_callback callback;
+    dlfcn_win32_stats *stats;
+    ULONGLONG trace_start;
     HMODULE hModule;
     UINT uMode;
 
-    error_occurred = FALSE;
+    callback = trace_callback;
+    trace_start = callback != NULL ? stats_ticks( ) : 0;
+
+    global_init( );
+
+    error_clear( );
+
+    stats = stats_get( );
+    STATS_ADD( stats->dlopen_calls, 1 );
 
     /* Do not let Windows display the critical-error-handler message box */
     uMode = MySetErrorMode( SEM_FAILCRITICALERRORS );
@@ -379,144 +2761,429 @@ void *dlopen( const char *file, int mode )
         if( !hModule )
             save_err_str( "(null)", GetLastError( ) );
     }
+    else if( (mode & RTLD_DEFER_LOAD) && (mode & RTLD_LOCAL) && !(mode & RTLD_NOLOAD) )
+    {
+        /* Only the file is recorded, see lazy_handle_resolve( ) */
+        if( strlen( file ) >= MAX_PATH )
+        {
+            save_err_str( file, ERROR_FILENAME_EXCED_RANGE );
+            hModule = NULL;
+        }
+        else if( !lazy_file_exists( file ) )
+        {
+            save_err_str( file, GetLastError( ) );
+            hModule = NULL;
+        }
+        else
+        {
+            hModule = (HMODULE) lazy_handle_new( file, mode & ~RTLD_DEFER_LOAD );
+
+            if( !hModule )
+                save_err_str( file, ERROR_NOT_ENOUGH_MEMORY );
+        }
+    }
     else
     {
-        HANDLE hCurrentProc;
-        DWORD dwProcModsBefore, dwProcModsAfter;
-        char lpFileName[MAX_PATH];
-        size_t i, len;
+        hModule = dlopen_file( file, mode, stats );
+    }
+
+    /* Return to previous state of the error-mode bit flags. */
+    MySetErrorMode( uMode );
+
+    if( hModule == NULL )
+        STATS_ADD( stats->dlopen_failures, 1 );
+
+    if( callback != NULL )
+        trace_call( callback, DLFCN_WIN32_TRACE_DLOPEN, trace_start, file, (void *) hModule, NULL, hModule != NULL );
+
+    return (void *) hModule;
+}
+
+/* Close module opened by dlopen_file( ), return FALSE on failure */
+static BOOL dlclose_module( HMODULE hModule, dlfcn_win32_stats *stats )
+{
+    module_data *pdata;
+    BOOL unload, queued;
+    ULONGLONG start;
+    BOOL ret;
+
+    /* The loader reference of a module opened by dlopen() several times is
+     * freed only by the last dlclose() and never for a pinned module. The
+     * last dlclose() removes the paths of the module from the cache first,
+     * so that a concurrent dlopen() calls the loader. In deferred close modes
+     * it only queues the reference, while the local list and module data are
+     * updated at once as if the module was unloaded.
+     */
+    unload = TRUE;
+    queued = FALSE;
+
+    lock_exclusive( );
+
+    pdata = module_data_search( hModule );
+
+    if( pdata != NULL && ( pdata->open_count > 1 || pdata->pinned ) )
+    {
+        if( pdata->open_count > 0 )
+            pdata->open_count--;
+        local_rem( hModule );
+        InterlockedIncrement( &module_generation );
+        unload = FALSE;
+    }
+    else if( pdata != NULL && pdata->open_count == 1 )
+    {
+        pdata->open_count = 0;
+        path_cache_rem( hModule );
+
+        if( close_mode != DLFCN_WIN32_CLOSE_NOW && close_queue_add( hModule ) )
+        {
+            local_rem( hModule );
+            module_data_close( hModule );
+            InterlockedIncrement( &module_generation );
+            unload = FALSE;
+            queued = TRUE;
+        }
+    }
+
+    unlock_exclusive( );
+
+    if( queued && close_mode == DLFCN_WIN32_CLOSE_BACKGROUND )
+        SetEvent( close_event );
 
-        len = strlen( file );
+    if( !unload )
+    {
+        ret = TRUE;
+    }
+    else
+    {
+        start = stats_ticks( );
+        ret = FreeLibrary( hModule );
+        STATS_ADD( stats->free_library_ns, stats_ticks( ) - start );
 
-        if( len >= sizeof( lpFileName ) )
+        /* If the object was loaded with RTLD_LOCAL, remove it from list of local
+         * objects.
+         */
+        if( ret )
         {
-            save_err_str( file, ERROR_FILENAME_EXCED_RANGE );
-            hModule = NULL;
+            lock_exclusive( );
+            local_rem( hModule );
+            module_data_close( hModule );
+            InterlockedIncrement( &module_generation );
+            unlock_exclusive( );
         }
         else
         {
-            /* MSDN says backslashes *must* be used instead of forward slashes. */
-            for( i = 0; i < len; i++ )
-            {
-                if( file[i] == '/' )
-                    lpFileName[i] = '\\';
-                else
-                    lpFileName[i] = file[i];
-            }
-            lpFileName[len] = '\0';
+            save_err_ptr_str( (void *) hModule, GetLastError( ) );
+            STATS_ADD( stats->dlclose_failures, 1 );
+        }
+    }
+
+    return ret;
+}
+
+DLFCN_EXPORT
+int dlclose( void *handle )
+{
+    dlfcn_win32_trace_callback callback;
+    dlfcn_win32_stats *stats;
+    ULONGLONG trace_start;
+    lazy_handle *lazy;
+    BOOL ret;
 
-            hCurrentProc = GetCurrentProcess( );
+    callback = trace_callback;
+    trace_start = callback != NULL ? stats_ticks( ) : 0;
 
-            if( MyEnumProcessModules( hCurrentProc, NULL, 0, &dwProcModsBefore ) == 0 )
-                dwProcModsBefore = 0;
+    global_init( );
 
-            /* POSIX says the search path is implementation-defined.
-             * LOAD_WITH_ALTERED_SEARCH_PATH is used to make it behave more closely
-             * to UNIX's search paths (start with system folders instead of current
-             * folder).
-             */
-            hModule = LoadLibraryExA( lpFileName, NULL, LOAD_WITH_ALTERED_SEARCH_PATH );
+    error_clear( );
 
-            if( !hModule )
-            {
-                save_err_str( lpFileName, GetLastError( ) );
-            }
-            else
-            {
-                if( MyEnumProcessModules( hCurrentProc, NULL, 0, &dwProcModsAfter ) == 0 )
-                    dwProcModsAfter = 0;
+    stats = stats_get( );
+    STATS_ADD( stats->dlclose_calls, 1 );
 
-                /* If the object was loaded with RTLD_LOCAL, add it to list of local
-                 * objects, so that its symbols cannot be retrieved even if the handle for
-                 * the original program file is passed. POSIX says that if the same
-                 * file is specified in multiple invocations, and any of them are
-                 * RTLD_GLOBAL, even if any further invocations use RTLD_LOCAL, the
-                 * symbols will remain global. If number of loaded modules was not
-                 * changed after calling LoadLibraryEx(), it means that library was
-                 * already loaded.
-                 */
-                if( (mode & RTLD_LOCAL) && dwProcModsBefore != dwProcModsAfter )
-                {
-                    if( !local_add( hModule ) )
-                    {
-                        save_err_str( lpFileName, ERROR_NOT_ENOUGH_MEMORY );
-                        FreeLibrary( hModule );
-                        hModule = NULL;
-                    }
-                }
-                else if( !(mode & RTLD_LOCAL) && dwProcModsBefore == dwProcModsAfter )
-                {
-                    local_rem( hModule );
-                }
-            }
+    /* Module of a lazy handle is closed only when it was loaded */
+    lazy = lazy_handle_take( handle );
+
+    if( lazy != NULL )
+    {
+        ret = lazy->hModule == NULL || dlclose_module( lazy->hModule, stats );
+        free( lazy );
+    }
+    else
+    {
+        ret = dlclose_module( (HMODULE) handle, stats );
+    }
+
+    if( callback != NULL )
+        trace_call( callback, DLFCN_WIN32_TRACE_DLCLOSE, trace_start, NULL, handle, NULL, ret );
+
+    /* dlclose's return value in inverted in relation to FreeLibrary's. */
+    ret = !ret;
+
+    return (int) ret;
+}
+
+/* Replace lazy handle by its module, which is loaded by the first call.
+ * Return FALSE when loading failed, the error is saved for dlerror().
+ */
+static BOOL lazy_handle_resolve( void **handle, dlfcn_win32_stats *stats )
+{
+    lazy_handle *lazy;
+    HMODULE hModule;
+    HMODULE hLoaded;
+    UINT uMode;
+
+    if( lazy_handle_count == 0 )
+        return TRUE;
+
+    hModule = NULL;
+
+    lock_shared( );
+    lazy = lazy_handle_search( *handle );
+    if( lazy != NULL )
+        hModule = lazy->hModule;
+    unlock_shared( );
+
+    if( lazy == NULL )
+        return TRUE;
+
+    if( hModule == NULL )
+    {
+        /* Same as dlopen(), the loader must not be called with the lock */
+        uMode = MySetErrorMode( SEM_FAILCRITICALERRORS );
+        hModule = dlopen_file( lazy->file, lazy->mode, stats );
+        MySetErrorMode( uMode );
+
+        if( hModule == NULL )
+            return FALSE;
+
+        lock_exclusive( );
+        hLoaded = lazy->hModule;
+        if( hLoaded == NULL )
+            lazy->hModule = hModule;
+        unlock_exclusive( );
+
+        /* Another thread loaded the module meanwhile */
+        if( hLoaded != NULL )
+        {
+            dlclose_module( hModule, stats );
+            hModule = hLoaded;
+        }
+    }
+
+    *handle = hModule;
+
+    return TRUE;
+}
+
+DLFCN_NOINLINE /* Needed for _ReturnAddress() */
+DLFCN_EXPORT
+void *dlsym( void *handle, const char *name )
+{
+    dlfcn_win32_trace_callback callback;
+    dlfcn_win32_stats *stats;
+    ULONGLONG trace_start;
+    void *trace_handle;
+    FARPROC symbol;
+    HMODULE hCaller;
+    HMODULE hModule;
+    DWORD dwMessageId;
+    LONG generation;
+    BOOL cacheable;
+    BOOL loaded;
+
+    callback = trace_callback;
+    trace_start = callback != NULL ? stats_ticks( ) : 0;
+    trace_handle = handle;
+
+    global_init( );
+
+    error_clear( );
+
+    stats = stats_get( );
+    STATS_ADD( stats->dlsym_calls, 1 );
+
+    symbol = NULL;
+    hCaller = NULL;
+    hModule = GetModuleHandle( NULL );
+    dwMessageId = 0;
+    generation = 0;
+    cacheable = FALSE;
+
+    /* Error of loading the module of a lazy handle is reported instead */
+    loaded = lazy_handle_resolve( &handle, stats );
+    if( !loaded )
+        goto end;
+
+    if( handle == RTLD_DEFAULT )
+    {
+        /* The symbol lookup happens in the normal global scope; that is,
+         * a search for a symbol using this handle would find the same
+         * definition as a direct use of this symbol in the program code.
+         * So use same lookup procedure as when filename is NULL.
+         */
+        handle = hModule;
+    }
+    else if( handle == RTLD_NEXT )
+    {
+        /* Specifies the next object after this one that defines name.
+         * This one refers to the object containing the invocation of dlsym().
+         * The next object is the one found upon the application of a load
+         * order symbol resolution algorithm. To get caller function of dlsym()
+         * use _ReturnAddress() intrinsic. To get HMODULE of caller function
+         * use MyGetModuleHandleFromAddress() which calls either standard
+         * GetModuleHandleExA() function or hack via VirtualQuery().
+         */
+        hCaller = MyGetModuleHandleFromAddress( _ReturnAddress( ) );
+
+        if( hCaller == NULL )
+        {
+            dwMessageId = ERROR_INVALID_PARAMETER;
+            goto end;
+        }
+    }
+
+    /* Results of lookups in the global scope are cached until some module is
+     * loaded or unloaded. Symbols given by ordinal are not cached.
+     */
+    if( hModule == handle && ( (ULONG_PTR) name >> 16 ) != 0 && dll_notification_cookie != NULL )
+    {
+        generation = module_generation;
+
+        if( global_cache_search( name, generation, &symbol ) )
+        {
+            STATS_ADD( stats->dlsym_cache_hits, 1 );
+            goto end;
+        }
+
+        cacheable = TRUE;
+    }
+
+    if( handle != RTLD_NEXT )
+    {
+        /* Modules returned by dlopen() are known to be loaded, so their
+         * export table can be used directly. Everything else goes through
+         * GetProcAddress() which validates the handle.
+         */
+        if( ( hModule != handle && !module_data_is_open( (HMODULE) handle ) ) || !find_export( (HMODULE) handle, name, &symbol ) )
+            symbol = GetProcAddress( (HMODULE) handle, name );
+
+        if( symbol != NULL )
+            goto end;
+    }
+
+    /* If the handle for the original program file is passed, also search
+     * in all globally loaded objects.
+     */
+
+    if( hModule == handle || handle == RTLD_NEXT )
+    {
+        module_list *list;
+        BOOL local;
+        DWORD i;
+
+        list = module_list_acquire( );
+
+        if( list == NULL )
+        {
+            if( GetLastError( ) == ERROR_NOT_ENOUGH_MEMORY )
+                dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
+            goto end;
         }
-    }
 
-    /* Return to previous state of the error-mode bit flags. */
-    MySetErrorMode( uMode );
+        STATS_ADD( stats->global_lookups, 1 );
 
-    return (void *) hModule;
-}
+        for( i = 0; i < list->count; i++ )
+        {
+            if( handle == RTLD_NEXT && hCaller )
+            {
+                /* Next modules can be used for RTLD_NEXT */
+                if( hCaller == list->modules[i] )
+                    hCaller = NULL;
+                continue;
+            }
+            lock_shared( );
+            local = local_search( list->modules[i] );
+            unlock_shared( );
+            if( local )
+                continue;
+            STATS_ADD( stats->modules_walked, 1 );
+            symbol = GetProcAddress( list->modules[i], name );
+            if( symbol != NULL )
+                break;
+        }
 
-DLFCN_EXPORT
-int dlclose( void *handle )
-{
-    HMODULE hModule = (HMODULE) handle;
-    BOOL ret;
+        module_list_release( list );
 
-    error_occurred = FALSE;
+        /* All modules were searched, so the symbol does not exist */
+        if( symbol == NULL && cacheable )
+            global_cache_add( name, generation, NULL );
+    }
 
-    ret = FreeLibrary( hModule );
+end:
+    if( symbol != NULL && cacheable )
+        global_cache_add( name, generation, symbol );
 
-    /* If the object was loaded with RTLD_LOCAL, remove it from list of local
-     * objects.
-     */
-    if( ret )
-        local_rem( hModule );
-    else
-        save_err_ptr_str( handle, GetLastError( ) );
+    if( symbol == NULL )
+    {
+        if( !dwMessageId )
+            dwMessageId = ERROR_PROC_NOT_FOUND;
+        if( loaded )
+            save_err_str( name, dwMessageId );
+        STATS_ADD( stats->dlsym_misses, 1 );
+    }
 
-    /* dlclose's return value in inverted in relation to FreeLibrary's. */
-    ret = !ret;
+    if( callback != NULL )
+        trace_call( callback, DLFCN_WIN32_TRACE_DLSYM, trace_start, name, trace_handle, *(void **) (&symbol), symbol != NULL );
 
-    return (int) ret;
+    return *(void **) (&symbol);
 }
 
+/* Markers used by dlsym_many( ) for entries which still need a lookup by
+ * GetProcAddress( ) or which are known to be missing.
+ */
+static char dlsym_many_pending;
+static char dlsym_many_missing;
+
 DLFCN_NOINLINE /* Needed for _ReturnAddress() */
 DLFCN_EXPORT
-void *dlsym( void *handle, const char *name )
+int dlsym_many( void *handle, const char *const *names, void **symbols, int count )
 {
     FARPROC symbol;
     HMODULE hCaller;
     HMODULE hModule;
     DWORD dwMessageId;
+    LONG generation;
+    BOOL cacheable;
+    BOOL loaded;
+    int i, missing;
+    dlfcn_win32_stats *stats;
 
-    error_occurred = FALSE;
+    global_init( );
+
+    error_clear( );
+
+    stats = stats_get( );
+    STATS_ADD( stats->dlsym_many_calls, 1 );
+    STATS_ADD( stats->dlsym_calls, count );
 
-    symbol = NULL;
     hCaller = NULL;
     hModule = GetModuleHandle( NULL );
     dwMessageId = 0;
+    generation = 0;
+    cacheable = FALSE;
+
+    for( i = 0; i < count; i++ )
+        symbols[i] = NULL;
+
+    loaded = lazy_handle_resolve( &handle, stats );
+    if( !loaded )
+        goto end;
 
     if( handle == RTLD_DEFAULT )
     {
-        /* The symbol lookup happens in the normal global scope; that is,
-         * a search for a symbol using this handle would find the same
-         * definition as a direct use of this symbol in the program code.
-         * So use same lookup procedure as when filename is NULL.
-         */
         handle = hModule;
     }
     else if( handle == RTLD_NEXT )
     {
-        /* Specifies the next object after this one that defines name.
-         * This one refers to the object containing the invocation of dlsym().
-         * The next object is the one found upon the application of a load
-         * order symbol resolution algorithm. To get caller function of dlsym()
-         * use _ReturnAddress() intrinsic. To get HMODULE of caller function
-         * use MyGetModuleHandleFromAddress() which calls either standard
-         * GetModuleHandleExA() function or hack via VirtualQuery().
-         */
         hCaller = MyGetModuleHandleFromAddress( _ReturnAddress( ) );
 
         if( hCaller == NULL )
@@ -526,166 +3193,498 @@ void *dlsym( void *handle, const char *name )
         }
     }
 
-    if( handle != RTLD_NEXT )
+    if( hModule != handle && handle != RTLD_NEXT )
     {
-        symbol = GetProcAddress( (HMODULE) handle, name );
+        IMAGE_EXPORT_DIRECTORY *ied;
+        DWORD iedSize;
+        module_data *pdata;
+        BOOL exclusive;
+
+        /* Resolve all names with one acquisition of the module's export
+         * name index, see dlsym( ) */
+        pdata = NULL;
+        if( module_data_is_open( (HMODULE) handle ) && get_image_section( (HMODULE) handle, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, &iedSize ) )
+            pdata = module_data_acquire( (HMODULE) handle, &exclusive );
+
+        for( i = 0; i < count; i++ )
+        {
+            if( pdata == NULL || !find_export_in( (HMODULE) handle, ied, iedSize, pdata, names[i], &symbol ) )
+                symbols[i] = &dlsym_many_pending;
+            else
+                symbols[i] = symbol != NULL ? *(void **) (&symbol) : &dlsym_many_missing;
+        }
 
-        if( symbol != NULL )
-            goto end;
+        if( pdata != NULL )
+            module_data_release( exclusive );
+
+        /* Lock is released, so GetProcAddress() can be called */
+        for( i = 0; i < count; i++ )
+        {
+            if( symbols[i] == &dlsym_many_pending )
+            {
+                symbol = GetProcAddress( (HMODULE) handle, names[i] );
+                symbols[i] = symbol != NULL ? *(void **) (&symbol) : &dlsym_many_missing;
+            }
+        }
     }
+    else
+    {
+        module_list *list;
+        BOOL local;
+        DWORD j;
 
-    /* If the handle for the original program file is passed, also search
-     * in all globally loaded objects.
-     */
+        missing = count;
 
-    if( hModule == handle || handle == RTLD_NEXT )
-    {
-        HANDLE hCurrentProc;
-        HMODULE *modules;
-        DWORD cbNeeded;
-        DWORD dwSize;
-        size_t i;
+        /* Results of lookups in the global scope are cached, see dlsym( ) */
+        if( hModule == handle && dll_notification_cookie != NULL )
+        {
+            generation = module_generation;
+            cacheable = TRUE;
+
+            for( i = 0; i < count; i++ )
+            {
+                if( ( (ULONG_PTR) names[i] >> 16 ) != 0 && global_cache_search( names[i], generation, &symbol ) )
+                {
+                    symbols[i] = symbol != NULL ? *(void **) (&symbol) : &dlsym_many_missing;
+                    STATS_ADD( stats->dlsym_cache_hits, 1 );
+                    missing--;
+                }
+            }
+        }
 
-        hCurrentProc = GetCurrentProcess( );
+        /* Executable is the first module in the list, so this finds the
+         * same symbols as dlsym( ), but walks the list only once */
+        list = NULL;
+        if( missing != 0 )
+        {
+            list = module_list_acquire( );
 
-        /* GetModuleHandle( NULL ) only returns the current program file. So
-         * if we want to get ALL loaded module including those in linked DLLs,
-         * we have to use EnumProcessModules( ).
-         */
-        if( MyEnumProcessModules( hCurrentProc, NULL, 0, &dwSize ) != 0 )
+            if( list == NULL )
+            {
+                if( GetLastError( ) == ERROR_NOT_ENOUGH_MEMORY )
+                    dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
+                cacheable = FALSE;
+            }
+            else
+                STATS_ADD( stats->global_lookups, 1 );
+        }
+
+        for( j = 0; list != NULL && j < list->count && missing != 0; j++ )
         {
-            modules = malloc( dwSize );
-            if( modules )
+            if( handle == RTLD_NEXT && hCaller )
+            {
+                /* Next modules can be used for RTLD_NEXT */
+                if( hCaller == list->modules[j] )
+                    hCaller = NULL;
+                continue;
+            }
+            lock_shared( );
+            local = local_search( list->modules[j] );
+            unlock_shared( );
+            if( local )
+                continue;
+
+            STATS_ADD( stats->modules_walked, 1 );
+
+            for( i = 0; i < count; i++ )
             {
-                if( MyEnumProcessModules( hCurrentProc, modules, dwSize, &cbNeeded ) != 0 && dwSize == cbNeeded )
+                if( symbols[i] != NULL )
+                    continue;
+
+                symbol = GetProcAddress( list->modules[j], names[i] );
+                if( symbol != NULL )
                 {
-                    for( i = 0; i < dwSize / sizeof( HMODULE ); i++ )
-                    {
-                        if( handle == RTLD_NEXT && hCaller )
-                        {
-                            /* Next modules can be used for RTLD_NEXT */
-                            if( hCaller == modules[i] )
-                                hCaller = NULL;
-                            continue;
-                        }
-                        if( local_search( modules[i] ) )
-                            continue;
-                        symbol = GetProcAddress( modules[i], name );
-                        if( symbol != NULL )
-                        {
-                            free( modules );
-                            goto end;
-                        }
-                    }
+                    symbols[i] = *(void **) (&symbol);
+                    missing--;
 
+                    if( cacheable && ( (ULONG_PTR) names[i] >> 16 ) != 0 )
+                        global_cache_add( names[i], generation, symbol );
                 }
-                free( modules );
             }
-            else
+        }
+
+        if( list != NULL )
+            module_list_release( list );
+
+        /* All modules were searched, so these symbols do not exist */
+        for( i = 0; i < count; i++ )
+        {
+            if( symbols[i] == NULL )
             {
-                dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
-                goto end;
+                symbols[i] = &dlsym_many_missing;
+                if( cacheable && ( (ULONG_PTR) names[i] >> 16 ) != 0 )
+                    global_cache_add( names[i], generation, NULL );
             }
         }
     }
 
 end:
-    if( symbol == NULL )
+    /* Only one error is reported, missing entries are left NULL */
+    missing = 0;
+    for( i = 0; i < count; i++ )
     {
-        if( !dwMessageId )
-            dwMessageId = ERROR_PROC_NOT_FOUND;
-        save_err_str( name, dwMessageId );
+        if( symbols[i] == &dlsym_many_missing || symbols[i] == NULL )
+        {
+            symbols[i] = NULL;
+            if( missing++ == 0 && loaded )
+            {
+                if( !dwMessageId )
+                    dwMessageId = ERROR_PROC_NOT_FOUND;
+                if( ( (ULONG_PTR) names[i] >> 16 ) != 0 )
+                    save_err_str( names[i], dwMessageId );
+                else
+                    save_err_ptr_str( names[i], dwMessageId );
+            }
+        }
     }
 
-    return *(void **) (&symbol);
+    STATS_ADD( stats->dlsym_misses, missing );
+
+    return missing;
+}
+
+/* Find RVA of a name or ordinal given as for dlsym( ) */
+static BOOL find_file_export( const pe_image *image, const char *name, unsigned long *rva )
+{
+    if( ( (ULONG_PTR) name >> 16 ) != 0 )
+        return pe_export_find( image, name, rva );
+    else
+        return pe_export_find_ordinal( image, (unsigned long) (ULONG_PTR) name, rva );
 }
 
 DLFCN_EXPORT
-char *dlerror( void )
+int dlsym_peek( const char *file, const char *const *names, int *found, int count )
 {
-    /* If this is the second consecutive call to dlerror, return NULL */
-    if( !error_occurred )
-        return NULL;
+    const void *view;
+    DWORD dwSize;
+    DWORD dwMessageId;
+    pe_image image;
+    unsigned long rva;
+    int i, ret;
 
-    /* POSIX says that invoking dlerror( ) a second time, immediately following
-     * a prior invocation, shall result in NULL being returned.
-     */
-    error_occurred = FALSE;
+    global_init( );
+
+    error_clear( );
+
+    if( file == NULL )
+    {
+        save_err_str( "(null)", ERROR_INVALID_PARAMETER );
+        return -1;
+    }
+
+    view = map_file( file, &dwSize, &dwMessageId );
+    if( view == NULL )
+    {
+        save_err_str( file, dwMessageId );
+        return -1;
+    }
+
+    ret = -1;
+
+    if( pe_image_init( &image, view, dwSize, 0 ) )
+    {
+        ret = 0;
+        for( i = 0; i < count; i++ )
+        {
+            found[i] = find_file_export( &image, names[i], &rva );
+            if( found[i] )
+                ret++;
+        }
+    }
 
-    return error_buffer;
+    UnmapViewOfFile( view );
+
+    if( ret < 0 )
+        save_err_str( file, ERROR_BAD_EXE_FORMAT );
+
+    return ret;
 }
 
-/* See https://docs.microsoft.com/en-us/archive/msdn-magazine/2002/march/inside-windows-an-in-depth-look-into-the-win32-portable-executable-file-format-part-2
- * for details */
+/* Files of a dlsym_scan( ) call, shared by its worker threads */
+typedef struct scan_job {
+    char **files;
+    LONG nfiles;
+    volatile LONG next;         /* Index of the next file to parse */
+    const char *const *names;
+    int count;
+    unsigned long *rvas;        /* count RVAs for each file */
+    BOOL *matched;
+} scan_job;
+
+/* Check whether file exports all names and store their RVAs. Files which
+ * cannot be read or are not PE files do not match.
+ */
+static BOOL scan_file( const char *file, const char *const *names, int count, unsigned long *rvas )
+{
+    const void *view;
+    DWORD dwSize;
+    DWORD dwError;
+    pe_image image;
+    BOOL ret;
+    int i;
 
-/* Get specific image section */
-static BOOL get_image_section( HMODULE module, int index, void **ptr, DWORD *size )
+    view = map_file( file, &dwSize, &dwError );
+    if( view == NULL )
+        return FALSE;
+
+    ret = pe_image_init( &image, view, dwSize, 0 );
+    for( i = 0; ret && i < count; i++ )
+        ret = find_file_export( &image, names[i], &rvas[i] );
+
+    UnmapViewOfFile( view );
+
+    return ret;
+}
+
+static DWORD WINAPI scan_worker( LPVOID param )
 {
-    IMAGE_DOS_HEADER *dosHeader;
-    IMAGE_NT_HEADERS *ntHeaders;
-    IMAGE_OPTIONAL_HEADER *optionalHeader;
+    scan_job *job = (scan_job *) param;
+    LONG i;
 
-    dosHeader = (IMAGE_DOS_HEADER *) module;
+    while( ( i = InterlockedIncrement( &job->next ) - 1 ) < job->nfiles )
+        job->matched[i] = scan_file( job->files[i], job->names, job->count, job->rvas + (size_t) i * job->count );
 
-    if( dosHeader->e_magic != IMAGE_DOS_SIGNATURE )
+    return 0;
+}
+
+/* List paths of the dll files in dir */
+static BOOL scan_list( const char *dir, scan_job *job, DWORD *error )
+{
+    WIN32_FIND_DATAA findData;
+    char pattern[MAX_PATH];
+    HANDLE hFind;
+    char **files;
+    size_t dirLen, nameLen;
+    LONG size;
+
+    dirLen = strlen( dir );
+    if( dirLen + sizeof( "\\*.dll" ) > sizeof( pattern ) )
+    {
+        *error = ERROR_FILENAME_EXCED_RANGE;
         return FALSE;
+    }
 
-    ntHeaders = (IMAGE_NT_HEADERS *) ( (BYTE *) dosHeader + dosHeader->e_lfanew );
+    memcpy( pattern, dir, dirLen );
+    if( dirLen != 0 && dir[dirLen - 1] != '\\' && dir[dirLen - 1] != '/' )
+        pattern[dirLen++] = '\\';
+    memcpy( pattern + dirLen, "*.dll", sizeof( "*.dll" ) );
 
-    if( ntHeaders->Signature != IMAGE_NT_SIGNATURE )
-        return FALSE;
+    hFind = FindFirstFileA( pattern, &findData );
+    if( hFind == INVALID_HANDLE_VALUE )
+    {
+        /* Directory without dll files */
+        *error = GetLastError( );
+        return *error == ERROR_FILE_NOT_FOUND;
+    }
 
-    optionalHeader = &ntHeaders->OptionalHeader;
+    size = 0;
+    *error = 0;
 
-    if( optionalHeader->Magic != IMAGE_NT_OPTIONAL_HDR_MAGIC )
-        return FALSE;
+    do
+    {
+        if( findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY )
+            continue;
 
-    if( index < 0 || index >= IMAGE_NUMBEROF_DIRECTORY_ENTRIES || index >= optionalHeader->NumberOfRvaAndSizes )
-        return FALSE;
+        /* The pattern also matches short 8.3 names, so e.g. a file named
+         * "a.dllx" is found through its short name "A~1.DLL".
+         */
+        nameLen = strlen( findData.cFileName );
+        if( nameLen < 4 || lstrcmpiA( findData.cFileName + nameLen - 4, ".dll" ) != 0 )
+            continue;
 
-    if( optionalHeader->DataDirectory[index].Size == 0 || optionalHeader->DataDirectory[index].VirtualAddress == 0 )
-        return FALSE;
+        if( job->nfiles == size )
+        {
+            size = size ? size * 2 : 64;
+            files = (char **) realloc( job->files, size * sizeof( char * ) );
+            if( files == NULL )
+            {
+                *error = ERROR_NOT_ENOUGH_MEMORY;
+                break;
+            }
+            job->files = files;
+        }
 
-    if( size != NULL )
-        *size = optionalHeader->DataDirectory[index].Size;
+        job->files[job->nfiles] = (char *) malloc( dirLen + nameLen + 1 );
+        if( job->files[job->nfiles] == NULL )
+        {
+            *error = ERROR_NOT_ENOUGH_MEMORY;
+            break;
+        }
+        memcpy( job->files[job->nfiles], pattern, dirLen );
+        memcpy( job->files[job->nfiles] + dirLen, findData.cFileName, nameLen + 1 );
+        job->nfiles++;
+    }
+    while( FindNextFileA( hFind, &findData ) );
 
-    *ptr = (void *)( (BYTE *) module + optionalHeader->DataDirectory[index].VirtualAddress );
+    if( *error == 0 && GetLastError( ) != ERROR_NO_MORE_FILES )
+        *error = GetLastError( );
 
-    return TRUE;
+    FindClose( hFind );
+
+    return *error == 0;
 }
 
-/* Return symbol name for a given address from export table */
-static const char *get_export_symbol_name( HMODULE module, IMAGE_EXPORT_DIRECTORY *ied, const void *addr, void **func_address )
+DLFCN_EXPORT
+int dlsym_scan( const char *dir, const char *const *names, int count, int threads, dlsym_scan_result **results )
 {
-    DWORD i;
-    void *candidateAddr = NULL;
-    int candidateIndex = -1;
-    BYTE *base = (BYTE *) module;
-    DWORD *functionAddressesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfFunctions);
-    DWORD *functionNamesOffsets = (DWORD *) (base + (DWORD) ied->AddressOfNames);
-    USHORT *functionNameOrdinalsIndexes = (USHORT *) (base + (DWORD) ied->AddressOfNameOrdinals);
+    HANDLE workers[MAXIMUM_WAIT_OBJECTS];
+    SYSTEM_INFO info;
+    scan_job job;
+    DWORD dwMessageId;
+    DWORD nworkers;
+    LONG i;
+    int nresults;
 
-    for( i = 0; i < ied->NumberOfFunctions; i++ )
+    global_init( );
+
+    error_clear( );
+
+    *results = NULL;
+
+    if( dir == NULL || count < 0 )
     {
-        if( (void *) ( base + functionAddressesOffsets[i] ) > addr || candidateAddr >= (void *) ( base + functionAddressesOffsets[i] ) )
+        save_err_str( dir != NULL ? dir : "(null)", ERROR_INVALID_PARAMETER );
+        return -1;
+    }
+
+    memset( &job, 0, sizeof( job ) );
+    job.names = names;
+    job.count = count;
+    nworkers = 0;
+    nresults = -1;
+
+    if( !scan_list( dir, &job, &dwMessageId ) )
+        goto end;
+
+    job.rvas = (unsigned long *) malloc( ( (size_t) job.nfiles * count + 1 ) * sizeof( unsigned long ) );
+    job.matched = (BOOL *) malloc( ( job.nfiles + 1 ) * sizeof( BOOL ) );
+    if( job.rvas == NULL || job.matched == NULL )
+    {
+        dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
+        goto end;
+    }
+
+    if( threads <= 0 )
+    {
+        GetSystemInfo( &info );
+        threads = (int) info.dwNumberOfProcessors;
+    }
+    if( threads > job.nfiles )
+        threads = job.nfiles;
+    if( threads > MAXIMUM_WAIT_OBJECTS )
+        threads = MAXIMUM_WAIT_OBJECTS;
+
+    /* The calling thread is one of the workers. Files are handed out one by
+     * one, so a slow file does not hold back a whole share of the others. */
+    for( nworkers = 0; (int) nworkers + 1 < threads; nworkers++ )
+    {
+        workers[nworkers] = CreateThread( NULL, 0, scan_worker, &job, 0, NULL );
+        if( workers[nworkers] == NULL )
+            break;
+    }
+
+    scan_worker( &job );
+
+    if( nworkers != 0 )
+        WaitForMultipleObjects( nworkers, workers, TRUE, INFINITE );
+
+    nresults = 0;
+    for( i = 0; i < job.nfiles; i++ )
+        if( job.matched[i] )
+            nresults++;
+
+    if( nresults == 0 )
+        goto end;
+
+    *results = (dlsym_scan_result *) malloc( nresults * sizeof( dlsym_scan_result ) );
+    if( *results == NULL )
+    {
+        dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
+        nresults = -1;
+        goto end;
+    }
+
+    /* RVAs and name of a result share one allocation */
+    nresults = 0;
+    for( i = 0; i < job.nfiles; i++ )
+    {
+        dlsym_scan_result *result;
+        size_t len;
+
+        if( !job.matched[i] )
             continue;
 
-        candidateAddr = (void *) ( base + functionAddressesOffsets[i] );
-        candidateIndex = i;
+        result = &( *results )[nresults];
+        len = strlen( job.files[i] );
+        result->rvas = (unsigned long *) malloc( count * sizeof( unsigned long ) + len + 1 );
+        if( result->rvas == NULL )
+        {
+            dlsym_scan_free( *results, nresults );
+            *results = NULL;
+            dwMessageId = ERROR_NOT_ENOUGH_MEMORY;
+            nresults = -1;
+            goto end;
+        }
+        result->fname = (char *) ( result->rvas + count );
+        memcpy( result->rvas, job.rvas + (size_t) i * count, count * sizeof( unsigned long ) );
+        memcpy( result->fname, job.files[i], len + 1 );
+        nresults++;
     }
 
-    if( candidateIndex == -1 )
+end:
+    for( i = 0; i < (LONG) nworkers; i++ )
+        CloseHandle( workers[i] );
+
+    for( i = 0; i < job.nfiles; i++ )
+        free( job.files[i] );
+    free( job.files );
+    free( job.rvas );
+    free( job.matched );
+
+    if( nresults < 0 )
+        save_err_str( dir, dwMessageId );
+
+    return nresults;
+}
+
+DLFCN_EXPORT
+void dlsym_scan_free( dlsym_scan_result *results, int nresults )
+{
+    int i;
+
+    if( results == NULL )
+        return;
+
+    for( i = 0; i < nresults; i++ )
+        free( results[i].rvas );
+    free( results );
+}
+
+DLFCN_EXPORT
+char *dlerror( void )
+{
+    thread_state *state;
+
+    global_init( );
+
+    state = thread_state_get( FALSE );
+
+    /* If this is the second consecutive call to dlerror, return NULL */
+    if( state == NULL || !state->occurred )
         return NULL;
 
-    *func_address = candidateAddr;
+    /* POSIX says that invoking dlerror( ) a second time, immediately following
+     * a prior invocation, shall result in NULL being returned.
+     */
+    state->occurred = FALSE;
 
-    for( i = 0; i < ied->NumberOfNames; i++ )
-    {
-        if( functionNameOrdinalsIndexes[i] == candidateIndex )
-            return (const char *) ( base + functionNamesOffsets[i] );
-    }
+    if( state->pending )
+        error_format( state );
 
-    return NULL;
+    if( state->message == NULL )
+        return error_no_memory;
+
+    return state->message;
 }
 
 static BOOL is_valid_address( const void *addr )
@@ -802,67 +3801,185 @@ static void *get_address_from_import_address_table( void *iat, DWORD iat_size, c
 #endif
 #endif
 
-    if( !is_valid_address( ptr ) || ptr < (BYTE *) iat || ptr > (BYTE *) iat + iat_size )
+    /* The size of the table is only estimated when the module has no IAT
+     * directory, see resolve_address( ), so the entry is also validated */
+    if( ptr < (BYTE *) iat || ptr + sizeof( void * ) > (BYTE *) iat + iat_size || !is_valid_address( ptr ) )
         return NULL;
 
     return *(void **) ptr;
 }
 
-/* Holds module filename */
-static char module_filename[2*MAX_PATH];
-
-static BOOL fill_info( const void *addr, Dl_info *info )
+/* Get path of the module cached in its module data, so that the returned
+ * pointer stays valid until the module is closed by dlclose() and repeated
+ * calls do not need GetModuleFileNameA().
+ */
+static const char *get_module_filename( HMODULE hModule )
 {
-    HMODULE hModule;
+    char filename[2*MAX_PATH];
+    IMAGE_NT_HEADERS *ntHeaders;
+    module_data *pdata;
+    const char *ret;
     DWORD dwSize;
-    IMAGE_EXPORT_DIRECTORY *ied;
-    void *funcAddress = NULL;
+    char *copy;
 
-    /* Get module of the specified address */
-    hModule = MyGetModuleHandleFromAddress( addr );
+    ntHeaders = get_nt_headers( hModule );
 
-    if( hModule == NULL )
-        return FALSE;
+    if( ntHeaders == NULL )
+        return NULL;
 
-    dwSize = GetModuleFileNameA( hModule, module_filename, sizeof( module_filename ) );
+    lock_shared( );
+    pdata = module_data_search( hModule );
+    ret = NULL;
+    if( pdata != NULL && pdata->dwTimeDateStamp == ntHeaders->FileHeader.TimeDateStamp && pdata->dwSizeOfImage == ntHeaders->OptionalHeader.SizeOfImage )
+        ret = pdata->filename;
+    unlock_shared( );
 
-    if( dwSize == 0 || dwSize == sizeof( module_filename ) )
-        return FALSE;
+    if( ret != NULL )
+        return ret;
+
+    /* Loader lock is taken by GetModuleFileNameA(), so it must not be called
+     * with the state lock held */
+    dwSize = GetModuleFileNameA( hModule, filename, sizeof( filename ) );
+
+    if( dwSize == 0 || dwSize == sizeof( filename ) )
+        return NULL;
+
+    copy = (char *) malloc( dwSize + 1 );
+
+    if( copy == NULL )
+        return NULL;
+
+    memcpy( copy, filename, dwSize + 1 );
+
+    lock_exclusive( );
+
+    pdata = module_data_get( hModule );
+
+    if( pdata != NULL && pdata->filename == NULL )
+    {
+        pdata->filename = copy;
+        copy = NULL;
+    }
+
+    ret = pdata != NULL ? pdata->filename : NULL;
+
+    unlock_exclusive( );
+
+    free( copy );
+
+    return ret;
+}
+
+/* Fill symbol information of an address from the given module. Export
+ * lookups are done with the module data acquired by the caller, or by the
+ * slow linear scan when pdata is NULL.
+ */
+static void fill_info_symbol( HMODULE hModule, IMAGE_EXPORT_DIRECTORY *ied, module_data *pdata, const void *addr, Dl_info *info )
+{
+    void *funcAddress = NULL;
 
-    info->dli_fname = module_filename;
     info->dli_fbase = (void *) hModule;
 
-    /* Find function name and function address in module's export table */
-    if( get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, NULL ) )
-        info->dli_sname = get_export_symbol_name( hModule, ied, addr, &funcAddress );
-    else
+    if( ied == NULL )
         info->dli_sname = NULL;
+    else if( pdata != NULL )
+        info->dli_sname = find_export_symbol_name( hModule, pdata, addr, &funcAddress );
+    else
+        info->dli_sname = get_export_symbol_name( hModule, ied, addr, &funcAddress );
 
     info->dli_saddr = info->dli_sname == NULL ? NULL : funcAddress != NULL ? funcAddress : (void *) addr;
+}
+
+static BOOL fill_info( const void *addr, HMODULE hModule, Dl_info *info )
+{
+    IMAGE_EXPORT_DIRECTORY *ied;
+    module_data *pdata;
+    BOOL exclusive;
+
+    info->dli_fname = get_module_filename( hModule );
+
+    if( info->dli_fname == NULL )
+        return FALSE;
+
+    /* Find function name and function address in module's export table */
+    if( !get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, NULL ) )
+        ied = NULL;
+
+    pdata = ied != NULL ? module_data_acquire( hModule, &exclusive ) : NULL;
+
+    fill_info_symbol( hModule, ied, pdata, addr, info );
+
+    if( pdata != NULL )
+        module_data_release( exclusive );
 
     return TRUE;
 }
 
-DLFCN_EXPORT
-int dladdr( const void *addr, Dl_info *info )
+/* Get module which contains the address or NULL for addresses outside of
+ * any module. With loader notifications the sorted range table of the module
+ * snapshot is searched, which needs no system call. Otherwise the address is
+ * validated by VirtualQuery() first.
+ */
+static HMODULE get_module_from_address( const void *addr )
 {
-    if( info == NULL )
-        return 0;
+    module_list *list;
+    HMODULE hModule;
+
+    if( dll_notification_cookie != NULL )
+    {
+        list = module_list_acquire( );
+
+        if( list != NULL )
+        {
+            hModule = module_list_find( list, addr );
+            module_list_release( list );
+            return hModule;
+        }
+    }
 
     if( !is_valid_address( addr ) )
-        return 0;
+        return NULL;
+
+    return MyGetModuleHandleFromAddress( addr );
+}
+
+/* Resolve import thunks to the address of the imported function and get
+ * module of the address. Return NULL when no information can be provided.
+ */
+static const void *resolve_address( const void *addr, HMODULE *module )
+{
+    HMODULE hModule;
+    lazy_handle *lazy;
+
+    /* Lazy handle stands for its module once it is loaded, which is never
+     * done here */
+    if( lazy_handle_count != 0 )
+    {
+        hModule = NULL;
+
+        lock_shared( );
+        lazy = lazy_handle_search( addr );
+        if( lazy != NULL )
+            hModule = lazy->hModule;
+        unlock_shared( );
+
+        if( lazy != NULL )
+        {
+            if( hModule == NULL )
+                return NULL;
+            addr = hModule;
+        }
+    }
+
+    hModule = get_module_from_address( addr );
+
+    if( hModule == NULL )
+        return NULL;
 
     if( is_import_thunk( addr ) )
     {
         void *iat;
         DWORD iatSize;
-        HMODULE hModule;
-
-        /* Get module of the import thunk address */
-        hModule = MyGetModuleHandleFromAddress( addr );
-
-        if( hModule == NULL )
-            return 0;
 
         if( !get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_IAT, &iat, &iatSize ) )
         {
@@ -872,10 +3989,10 @@ int dladdr( const void *addr, Dl_info *info )
             DWORD iidSize;
 
             if( !get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_IMPORT, (void **) &iid, &iidSize ) )
-                return 0;
+                return NULL;
 
             if( iid == NULL || iid->Characteristics == 0 || iid->FirstThunk == 0 )
-                return 0;
+                return NULL;
 
             iat = (void *)( (BYTE *) hModule + (DWORD) iid->FirstThunk );
             /* We assume that in this case iid and iat's are in linear order */
@@ -884,22 +4001,389 @@ int dladdr( const void *addr, Dl_info *info )
 
         addr = get_address_from_import_address_table( iat, iatSize, addr );
 
-        if( !is_valid_address( addr ) )
-            return 0;
+        hModule = get_module_from_address( addr );
+
+        if( hModule == NULL )
+            return NULL;
+    }
+
+    *module = hModule;
+
+    return addr;
+}
+
+DLFCN_EXPORT
+int dladdr( const void *addr, Dl_info *info )
+{
+    dlfcn_win32_trace_callback callback;
+    dlfcn_win32_stats *stats;
+    ULONGLONG trace_start;
+    const void *resolved;
+    HMODULE hModule;
+    int ret;
+
+    if( info == NULL )
+        return 0;
+
+    callback = trace_callback;
+    trace_start = callback != NULL ? stats_ticks( ) : 0;
+
+    global_init( );
+
+    stats = stats_get( );
+    STATS_ADD( stats->dladdr_calls, 1 );
+
+    hModule = NULL;
+    resolved = resolve_address( addr, &hModule );
+
+    ret = resolved != NULL && fill_info( resolved, hModule, info );
+
+    if( !ret )
+        STATS_ADD( stats->dladdr_misses, 1 );
+
+    if( callback != NULL )
+        trace_call( callback, DLFCN_WIN32_TRACE_DLADDR, trace_start, NULL, ret ? (void *) hModule : NULL, addr, ret );
+
+    return ret;
+}
+
+/* Address of a dladdr_batch() request */
+typedef struct batch_entry {
+    const void *addr;   /* Resolved address */
+    HMODULE hModule;
+    int index;          /* Index into addrs and infos */
+} batch_entry;
+
+static int __cdecl compare_batch_entries( const void *a, const void *b )
+{
+    const batch_entry *ea = (const batch_entry *) a;
+    const batch_entry *eb = (const batch_entry *) b;
+
+    if( ea->hModule != eb->hModule )
+        return (ULONG_PTR) ea->hModule < (ULONG_PTR) eb->hModule ? -1 : 1;
+    if( ea->addr != eb->addr )
+        return (ULONG_PTR) ea->addr < (ULONG_PTR) eb->addr ? -1 : 1;
+    return 0;
+}
+
+DLFCN_EXPORT
+int dladdr_batch( const void *const *addrs, Dl_info *infos, int count )
+{
+    dlfcn_win32_stats *stats;
+    batch_entry *entries;
+    IMAGE_EXPORT_DIRECTORY *ied;
+    module_data *pdata;
+    const char *fname;
+    BOOL exclusive;
+    int i, j, n, found;
+
+    if( addrs == NULL || infos == NULL || count <= 0 )
+        return 0;
+
+    global_init( );
+
+    entries = (batch_entry *) malloc( count * sizeof( batch_entry ) );
+
+    /* Without memory for grouping fall back to one lookup per address */
+    if( entries == NULL )
+    {
+        found = 0;
+        for( i = 0; i < count; i++ )
+        {
+            if( dladdr( addrs[i], &infos[i] ) )
+                found++;
+            else
+                memset( &infos[i], 0, sizeof( Dl_info ) );
+        }
+        return found;
+    }
+
+    n = 0;
+    for( i = 0; i < count; i++ )
+    {
+        memset( &infos[i], 0, sizeof( Dl_info ) );
+
+        entries[n].addr = resolve_address( addrs[i], &entries[n].hModule );
+        if( entries[n].addr == NULL )
+            continue;
+
+        entries[n].index = i;
+        n++;
+    }
+
+    /* Group addresses by module, so that the file name and the export index
+     * of each module are looked up only once */
+    qsort( entries, n, sizeof( batch_entry ), compare_batch_entries );
+
+    found = 0;
+    for( i = 0; i < n; i = j )
+    {
+        HMODULE hModule = entries[i].hModule;
+
+        for( j = i + 1; j < n && entries[j].hModule == hModule; j++ );
+
+        fname = get_module_filename( hModule );
+        if( fname == NULL )
+            continue;
+
+        if( !get_image_section( hModule, IMAGE_DIRECTORY_ENTRY_EXPORT, (void **) &ied, NULL ) )
+            ied = NULL;
+
+        pdata = ied != NULL ? module_data_acquire( hModule, &exclusive ) : NULL;
+
+        for( ; i < j; i++ )
+        {
+            infos[entries[i].index].dli_fname = fname;
+            fill_info_symbol( hModule, ied, pdata, entries[i].addr, &infos[entries[i].index] );
+            found++;
+        }
+
+        if( pdata != NULL )
+            module_data_release( exclusive );
     }
 
-    if( !fill_info( addr, info ) )
+    free( entries );
+
+    stats = stats_get( );
+    STATS_ADD( stats->dladdr_calls, count );
+    STATS_ADD( stats->dladdr_misses, count - found );
+
+    return found;
+}
+
+/* Copy name to buffer of the caller, NULL names stay NULL */
+static BOOL copy_name( const char **name, char *buffer, unsigned int size )
+{
+    size_t len;
+
+    if( *name == NULL )
+        return TRUE;
+
+    len = strlen( *name );
+
+    if( buffer == NULL || len >= size )
+        return FALSE;
+
+    memcpy( buffer, *name, len + 1 );
+    *name = buffer;
+
+    return TRUE;
+}
+
+DLFCN_EXPORT
+int dladdr_r( const void *addr, Dl_info *info, char *fname, unsigned int fname_size, char *sname, unsigned int sname_size )
+{
+    if( !dladdr( addr, info ) )
+        return 0;
+
+    if( !copy_name( &info->dli_fname, fname, fname_size ) || !copy_name( &info->dli_sname, sname, sname_size ) )
         return 0;
 
     return 1;
 }
 
+DLFCN_EXPORT
+dlfcn_win32_trace_callback dlfcn_win32_set_trace_callback( dlfcn_win32_trace_callback callback )
+{
+    PVOID previous;
+
+    previous = InterlockedExchangePointer( (PVOID volatile *) &trace_callback, *(PVOID *) &callback );
+
+    return *(dlfcn_win32_trace_callback *) &previous;
+}
+
+/* Unload modules queued by dlclose(), return their number. Errors of
+ * FreeLibrary( ) are not reported, dlclose() already succeeded. */
+static int close_flush( void )
+{
+    dlfcn_win32_stats *stats;
+    HMODULE *queue;
+    ULONGLONG start;
+    DWORD count, i;
+
+    EnterCriticalSection( &close_flush_lock );
+
+    lock_exclusive( );
+    queue = close_queue;
+    count = close_queue_count;
+    if( count != 0 )
+    {
+        close_queue = NULL;
+        close_queue_count = 0;
+        close_queue_size = 0;
+        close_flushing = queue;
+        close_flushing_count = count;
+    }
+    unlock_exclusive( );
+
+    if( count != 0 )
+    {
+        stats = stats_get( );
+        start = stats_ticks( );
+        for( i = 0; i < count; i++ )
+            FreeLibrary( queue[i] );
+        STATS_ADD( stats->free_library_ns, stats_ticks( ) - start );
+
+        lock_exclusive( );
+        close_flushing = NULL;
+        close_flushing_count = 0;
+        unlock_exclusive( );
+
+        free( queue );
+    }
+
+    LeaveCriticalSection( &close_flush_lock );
+
+    return (int) count;
+}
+
+static DWORD WINAPI close_worker( LPVOID lpParameter )
+{
+    (void) lpParameter;
+
+    do
+    {
+        WaitForSingleObject( close_event, INFINITE );
+        close_flush( );
+    }
+    while( close_mode == DLFCN_WIN32_CLOSE_BACKGROUND );
+
+    return 0;
+}
+
+DLFCN_EXPORT
+int dlfcn_win32_set_close_mode( int mode )
+{
+    HANDLE thread;
+    LONG previous;
+
+    global_init( );
+
+    if( mode != DLFCN_WIN32_CLOSE_NOW && mode != DLFCN_WIN32_CLOSE_DEFERRED && mode != DLFCN_WIN32_CLOSE_BACKGROUND )
+        return -1;
+
+    EnterCriticalSection( &close_mode_lock );
+
+    previous = close_mode;
+
+    if( mode == DLFCN_WIN32_CLOSE_BACKGROUND && close_event == NULL )
+    {
+        close_event = CreateEventA( NULL, FALSE, FALSE, NULL );
+
+        if( close_event == NULL )
+        {
+            LeaveCriticalSection( &close_mode_lock );
+            return -1;
+        }
+    }
+
+    /* The mode is set before the background thread starts, as the thread
+     * exits when it finds another mode */
+    lock_exclusive( );
+    close_mode = mode;
+    unlock_exclusive( );
+
+    if( mode == DLFCN_WIN32_CLOSE_BACKGROUND && previous != DLFCN_WIN32_CLOSE_BACKGROUND )
+    {
+        thread = CreateThread( NULL, 0, close_worker, NULL, 0, NULL );
+
+        if( thread == NULL )
+        {
+            lock_exclusive( );
+            close_mode = previous;
+            unlock_exclusive( );
+
+            if( previous == DLFCN_WIN32_CLOSE_NOW )
+                close_flush( );
+
+            LeaveCriticalSection( &close_mode_lock );
+            return -1;
+        }
+
+        close_thread = thread;
+
+        /* Modules queued in the explicit mode */
+        SetEvent( close_event );
+    }
+    else if( previous == DLFCN_WIN32_CLOSE_BACKGROUND && mode != DLFCN_WIN32_CLOSE_BACKGROUND )
+    {
+        SetEvent( close_event );
+        WaitForSingleObject( close_thread, INFINITE );
+        CloseHandle( close_thread );
+        close_thread = NULL;
+    }
+
+    /* Nothing may stay queued when dlclose() unloads at once */
+    if( mode == DLFCN_WIN32_CLOSE_NOW )
+        close_flush( );
+
+    LeaveCriticalSection( &close_mode_lock );
+
+    return (int) previous;
+}
+
+DLFCN_EXPORT
+int dlfcn_win32_flush_closes( void )
+{
+    global_init( );
+
+    return close_flush( );
+}
+
+/* Sum counters of all threads, the caller must hold thread_list_lock */
+static void stats_sum( dlfcn_win32_stats *stats )
+{
+    thread_state *state;
+
+    *stats = stats_retired;
+    stats_add( stats, &thread_fallback.stats );
+    for( state = thread_list; state != NULL; state = state->next )
+        stats_add( stats, &state->stats );
+}
+
+DLFCN_EXPORT
+void dlfcn_win32_get_stats( dlfcn_win32_stats *stats )
+{
+    unsigned long long *counters = (unsigned long long *) stats;
+    const unsigned long long *baseline = (const unsigned long long *) &stats_baseline;
+    size_t i;
+
+    if( stats == NULL )
+        return;
+
+    global_init( );
+
+    EnterCriticalSection( &thread_list_lock );
+    stats_sum( stats );
+    for( i = 0; i < STATS_COUNTERS; i++ )
+        counters[i] = counters[i] > baseline[i] ? counters[i] - baseline[i] : 0;
+    LeaveCriticalSection( &thread_list_lock );
+
+    stats->load_library_ns = stats_ticks_to_ns( stats->load_library_ns );
+    stats->free_library_ns = stats_ticks_to_ns( stats->free_library_ns );
+}
+
+DLFCN_EXPORT
+void dlfcn_win32_reset_stats( void )
+{
+    global_init( );
+
+    /* Counters of a thread are written only by the thread itself, so the
+     * reset is done by remembering the current sums */
+    EnterCriticalSection( &thread_list_lock );
+    stats_sum( &stats_baseline );
+    LeaveCriticalSection( &thread_list_lock );
+}
+
 #ifdef DLFCN_WIN32_SHARED
 BOOL WINAPI DllMain( HINSTANCE hinstDLL, DWORD fdwReason, LPVOID lpvReserved )
 {
     (void) hinstDLL;
-    (void) fdwReason;
     (void) lpvReserved;
+
+    if( fdwReason == DLL_THREAD_DETACH )
+        thread_detach( );
+
     return TRUE;
 }
 #endif
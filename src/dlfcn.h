@@ -53,6 +53,33 @@ extern "C" {
 /* All symbols are not made available for relocation processing by other modules. */
 #define RTLD_LOCAL  (1 << 2)
 
+/* Do not load the object, only return a handle if it is already loaded. Can
+ * be combined with RTLD_GLOBAL to make symbols of a local object global
+ * (no POSIX standard).
+ */
+#define RTLD_NOLOAD (1 << 3)
+
+/* Do not unload the object. dlclose() of it only updates the bookkeeping and
+ * it stays loaded until the process exits (no POSIX standard).
+ */
+#define RTLD_NODELETE (1 << 4)
+
+/* Also bind imports of the object which are delay-loaded, so that their first
+ * calls do not load dlls at an unexpected time. The delay-load helper is not
+ * involved, so its notification hooks are not called for them (no POSIX
+ * standard).
+ */
+#define RTLD_BIND_DELAY_IMPORTS (1 << 5)
+
+/* Together with RTLD_LOCAL only check that the file exists and postpone
+ * loading of the object to the first dlsym() of the handle, which reports
+ * errors of loading it. The handle is not the HMODULE of the object and
+ * dladdr() of it gives no information until the object is loaded. Without
+ * RTLD_LOCAL the object is loaded at once, so its symbols are in the global
+ * scope (no POSIX standard).
+ */
+#define RTLD_DEFER_LOAD (1 << 6)
+
 /* These two were added in The Open Group Base Specifications Issue 6.
  * Note: All other RTLD_* flags in any dlfcn.h are not standard compliant.
  */
@@ -66,7 +93,7 @@ extern "C" {
 /* Structure filled in by dladdr() */
 typedef struct dl_info
 {
-   const char *dli_fname;  /* Filename of defining object (thread unsafe and reused on every call to dladdr) */
+   const char *dli_fname;  /* Filename of defining object (valid until the object is closed by dlclose) */
    void       *dli_fbase;  /* Load address of that object */
    const char *dli_sname;  /* Name of nearest lower symbol */
    void       *dli_saddr;  /* Exact value of nearest symbol */
@@ -81,12 +108,138 @@ DLFCN_EXPORT int dlclose(void *handle);
 /* Get the address of a symbol from a symbol table handle. */
 DLFCN_EXPORT void *dlsym(void *handle, const char *name);
 
+/* Get the addresses of count symbols from a symbol table handle in one pass
+ * (no POSIX standard). Symbols which were not found are set to NULL and
+ * dlerror() reports only the first of them. Returns number of missing symbols.
+ */
+DLFCN_EXPORT int dlsym_many(void *handle, const char *const *names, void **symbols, int count);
+
+/* Check which of count names are exported by the dll file without loading it.
+ * The file is mapped read-only, so no code of it runs and its imports are not
+ * loaded. Names can be ordinals as for dlsym. found[i] is set to 1 when
+ * names[i] is exported and to 0 otherwise. Returns number of exported names
+ * or -1 if the file cannot be read or is not a PE file (no POSIX standard).
+ */
+DLFCN_EXPORT int dlsym_peek(const char *file, const char *const *names, int *found, int count);
+
+/* Dll file found by dlsym_scan() */
+typedef struct dlsym_scan_result
+{
+   char *fname;                 /* Path of the file */
+   unsigned long *rvas;         /* Relative virtual addresses of the names */
+} dlsym_scan_result;
+
+/* Find dll files in directory dir which export all count names, without
+ * loading them. Files are parsed by threads threads at the same time, 0 uses
+ * one thread per processor. On success *results is set to an array of the
+ * matching files, which must be freed by dlsym_scan_free(), and the number
+ * of matching files is returned. Returns -1 if the directory cannot be read
+ * (no POSIX standard).
+ */
+DLFCN_EXPORT int dlsym_scan(const char *dir, const char *const *names, int count, int threads, dlsym_scan_result **results);
+
+/* Free results of dlsym_scan() (no POSIX standard). */
+DLFCN_EXPORT void dlsym_scan_free(dlsym_scan_result *results, int nresults);
+
 /* Get diagnostic information. */
 DLFCN_EXPORT char *dlerror(void);
 
 /* Translate address to symbolic information (no POSIX standard) */
 DLFCN_EXPORT int dladdr(const void *addr, Dl_info *info);
 
+/* Translate count addresses at once, e.g. frames of a stack trace (no POSIX
+ * standard). Entries of infos for addresses without information are zeroed.
+ * Returns number of translated addresses.
+ */
+DLFCN_EXPORT int dladdr_batch(const void *const *addrs, Dl_info *infos, int count);
+
+/* Same as dladdr(), but the names are copied to buffers owned by the caller
+ * and dli_fname and dli_sname point to them (no POSIX standard). Fails when
+ * a name does not fit into its buffer.
+ */
+DLFCN_EXPORT int dladdr_r(const void *addr, Dl_info *info, char *fname, unsigned int fname_size, char *sname, unsigned int sname_size);
+
+/* Statistics of dlfcn-win32 since the start of the process or since the last
+ * dlfcn_win32_reset_stats() call (no POSIX standard). Counters are kept per
+ * thread, so they do not slow down concurrent calls.
+ */
+typedef struct dlfcn_win32_stats
+{
+   unsigned long long dlopen_calls;
+   unsigned long long dlopen_failures;
+   unsigned long long dlopen_cache_hits;     /* Modules returned again without calling the loader */
+   unsigned long long dlclose_calls;
+   unsigned long long dlclose_failures;
+   unsigned long long dlsym_calls;           /* Including symbols resolved by dlsym_many() */
+   unsigned long long dlsym_misses;
+   unsigned long long dlsym_cache_hits;      /* Global scope lookups answered from the cache */
+   unsigned long long dlsym_many_calls;
+   unsigned long long dladdr_calls;          /* Including addresses passed to dladdr_batch() */
+   unsigned long long dladdr_misses;
+   unsigned long long global_lookups;        /* Walks of the module list */
+   unsigned long long modules_walked;        /* Modules searched by these walks */
+   unsigned long long enum_process_modules_calls;
+   unsigned long long format_message_calls;
+   unsigned long long export_indexes_mapped; /* Export index files used by dlopen() */
+   unsigned long long load_library_ns;       /* Time spent in LoadLibraryExA() */
+   unsigned long long free_library_ns;       /* Time spent in FreeLibrary() */
+} dlfcn_win32_stats;
+
+/* Get statistics (no POSIX standard). */
+DLFCN_EXPORT void dlfcn_win32_get_stats(dlfcn_win32_stats *stats);
+
+/* Reset statistics to zero (no POSIX standard). */
+DLFCN_EXPORT void dlfcn_win32_reset_stats(void);
+
+/* Modes of dlfcn_win32_set_close_mode() */
+#define DLFCN_WIN32_CLOSE_NOW        0  /* Last dlclose() of an object unloads it (default) */
+#define DLFCN_WIN32_CLOSE_DEFERRED   1  /* Unloaded by dlfcn_win32_flush_closes() */
+#define DLFCN_WIN32_CLOSE_BACKGROUND 2  /* Unloaded by a background thread */
+
+/* Set when objects are unloaded. In the deferred modes the last dlclose() of
+ * an object only queues it, so the caller does not wait for the loader and
+ * detach routines of the object. Until it is unloaded, dlopen() of the object
+ * takes it back from the queue. Switching to DLFCN_WIN32_CLOSE_NOW unloads
+ * queued objects and stops the background thread, which must be done before
+ * the library itself is unloaded. Returns the previous mode or -1 on failure
+ * (no POSIX standard).
+ */
+DLFCN_EXPORT int dlfcn_win32_set_close_mode(int mode);
+
+/* Unload objects queued by dlclose() in the deferred modes. Returns number of
+ * unloaded objects (no POSIX standard).
+ */
+DLFCN_EXPORT int dlfcn_win32_flush_closes(void);
+
+/* Functions reported by the trace callback */
+#define DLFCN_WIN32_TRACE_DLOPEN  1
+#define DLFCN_WIN32_TRACE_DLCLOSE 2
+#define DLFCN_WIN32_TRACE_DLSYM   3
+#define DLFCN_WIN32_TRACE_DLADDR  4
+
+/* Call of a library function passed to the trace callback */
+typedef struct dlfcn_win32_trace_event
+{
+   int function;                 /* One of the DLFCN_WIN32_TRACE_* values */
+   int success;                  /* Nonzero if the call succeeded */
+   unsigned long thread_id;
+   unsigned long long start_ns;  /* Performance counter time of the call */
+   unsigned long long end_ns;
+   const char *name;             /* File of dlopen or symbol of dlsym, NULL otherwise */
+   unsigned int ordinal;         /* Ordinal passed to dlsym instead of a name, 0 otherwise */
+   void *handle;                 /* Handle passed to dlclose and dlsym, returned by dlopen or found by dladdr */
+   const void *addr;             /* Address returned by dlsym or passed to dladdr */
+} dlfcn_win32_trace_event;
+
+typedef void (*dlfcn_win32_trace_callback)(const dlfcn_win32_trace_event *event);
+
+/* Set callback invoked after each dlopen, dlclose, dlsym and dladdr call, NULL
+ * disables tracing. dlsym_many and dladdr_batch are not traced. The callback
+ * runs in the calling thread and must not call functions of this library.
+ * Returns the previous callback (no POSIX standard).
+ */
+DLFCN_EXPORT dlfcn_win32_trace_callback dlfcn_win32_set_trace_callback(dlfcn_win32_trace_callback callback);
+
 #ifdef __cplusplus
 }
 #endif
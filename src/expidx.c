@@ -0,0 +1,193 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "expidx.h"
+
+/* Sort entry of the export table */
+typedef struct expidx_export {
+    unsigned long rva;
+    unsigned long name;
+    unsigned long index;
+} expidx_export;
+
+static void write32( unsigned char *p, unsigned long value )
+{
+    p[0] = (unsigned char) value;
+    p[1] = (unsigned char) ( value >> 8 );
+    p[2] = (unsigned char) ( value >> 16 );
+    p[3] = (unsigned char) ( value >> 24 );
+}
+
+static unsigned long read32( const unsigned char *p )
+{
+    return (unsigned long) p[0] | ( (unsigned long) p[1] << 8 ) | ( (unsigned long) p[2] << 16 ) | ( (unsigned long) p[3] << 24 );
+}
+
+unsigned long expidx_hash_name( const char *name )
+{
+    unsigned long hash = 2166136261UL;
+
+    while( *name )
+    {
+        hash ^= (unsigned char) *name++;
+        hash = ( hash * 16777619UL ) & 0xffffffffUL;
+    }
+
+    return hash;
+}
+
+static int compare_exports( const void *a, const void *b )
+{
+    const expidx_export *ea = (const expidx_export *) a;
+    const expidx_export *eb = (const expidx_export *) b;
+
+    if( ea->rva != eb->rva )
+        return ea->rva < eb->rva ? -1 : 1;
+
+    if( ea->index != eb->index )
+        return ea->index < eb->index ? -1 : 1;
+
+    return 0;
+}
+
+/* For functions sharing the same address only the export with the lowest
+ * index is kept and its first name from AddressOfNames is used, which gives
+ * the same result as get_export_symbol_name( ) of dlfcn.c.
+ */
+int expidx_build( const pe_image *image, unsigned char **data, size_t *size )
+{
+    const unsigned char *functions, *names, *ordinals;
+    unsigned long nfunctions, nnames, nslots, count;
+    unsigned long i, j, slot, hash;
+    unsigned long *first_names;
+    expidx_export *exports;
+    unsigned char *p, *slots;
+    const char *name;
+
+    if( image->exports == NULL )
+        return 0;
+
+    nfunctions = read32( image->exports + 20 );
+    nnames = read32( image->exports + 24 );
+    functions = (const unsigned char *) pe_image_rva( image, read32( image->exports + 28 ), nfunctions * 4 );
+    names = (const unsigned char *) pe_image_rva( image, read32( image->exports + 32 ), nnames * 4 );
+    ordinals = (const unsigned char *) pe_image_rva( image, read32( image->exports + 36 ), nnames * 2 );
+
+    if( nfunctions == 0 || functions == NULL || ( nnames != 0 && ( names == NULL || ordinals == NULL ) ) || nfunctions > 0xffff || nnames > nfunctions )
+        return 0;
+
+    for( nslots = 16; nslots < 2 * nnames; nslots *= 2 );
+
+    first_names = (unsigned long *) calloc( nfunctions, sizeof( unsigned long ) );
+    exports = (expidx_export *) malloc( nfunctions * sizeof( expidx_export ) );
+    if( first_names == NULL || exports == NULL )
+    {
+        free( first_names );
+        free( exports );
+        return 0;
+    }
+
+    /* Walk names backwards, so the first name of each function wins */
+    for( i = nnames; i > 0; i-- )
+    {
+        j = ordinals[( i - 1 ) * 2] | ( (unsigned long) ordinals[( i - 1 ) * 2 + 1] << 8 );
+        if( j < nfunctions )
+            first_names[j] = read32( names + ( i - 1 ) * 4 );
+    }
+
+    count = 0;
+    for( i = 0; i < nfunctions; i++ )
+    {
+        /* Unused slots in the export table have zero address */
+        if( read32( functions + i * 4 ) == 0 )
+            continue;
+
+        exports[count].rva = read32( functions + i * 4 );
+        exports[count].name = first_names[i];
+        exports[count].index = i;
+        count++;
+    }
+
+    free( first_names );
+
+    qsort( exports, count, sizeof( expidx_export ), compare_exports );
+
+    /* Remove aliases, keep the entry with the lowest index for each address */
+    if( count > 1 )
+    {
+        for( i = 1, j = 0; i < count; i++ )
+        {
+            if( exports[i].rva != exports[j].rva )
+                exports[++j] = exports[i];
+        }
+
+        count = j + 1;
+    }
+
+    *size = EXPIDX_HEADER_SIZE + count * EXPIDX_EXPORT_SIZE + nslots * EXPIDX_SLOT_SIZE;
+    *data = (unsigned char *) calloc( *size, 1 );
+    if( *data == NULL )
+    {
+        free( exports );
+        return 0;
+    }
+
+    p = *data;
+    memcpy( p, EXPIDX_MAGIC, 4 );
+    write32( p + 4, EXPIDX_VERSION );
+    write32( p + 8, image->timestamp );
+    write32( p + 12, image->checksum );
+    write32( p + 16, image->size_of_image );
+    write32( p + 20, count );
+    write32( p + 24, nslots );
+
+    p += EXPIDX_HEADER_SIZE;
+    for( i = 0; i < count; i++, p += EXPIDX_EXPORT_SIZE )
+    {
+        write32( p, exports[i].rva );
+        write32( p + 4, exports[i].name );
+        write32( p + 8, exports[i].index );
+    }
+
+    free( exports );
+
+    slots = p;
+    for( i = 0; i < nnames; i++ )
+    {
+        name = (const char *) pe_image_rva( image, read32( names + i * 4 ), 1 );
+        if( name == NULL || memchr( name, '\0', image->size - ( (const unsigned char *) name - image->data ) ) == NULL )
+        {
+            free( *data );
+            *data = NULL;
+            return 0;
+        }
+
+        hash = expidx_hash_name( name );
+        for( slot = hash & ( nslots - 1 ); read32( slots + slot * EXPIDX_SLOT_SIZE + 4 ) != 0; slot = ( slot + 1 ) & ( nslots - 1 ) );
+        write32( slots + slot * EXPIDX_SLOT_SIZE, hash );
+        write32( slots + slot * EXPIDX_SLOT_SIZE + 4, i + 1 );
+    }
+
+    return 1;
+}
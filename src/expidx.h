@@ -0,0 +1,72 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef EXPIDX_H
+#define EXPIDX_H
+
+/* Precomputed export index of a dll, stored next to it as <dll>.expidx. It
+ * holds the two tables which dlfcn.c otherwise builds by expidx_build( ) when
+ * a module is first used by dladdr( ) and dlsym( ), so dlopen( ) can map the
+ * file and use the tables in place.
+ *
+ * All fields are 32-bit little endian:
+ *
+ *   header       "EXPX", version, TimeDateStamp, CheckSum and SizeOfImage of
+ *                the dll, number of exports, number of name slots, zero
+ *   exports      { rva, name rva, index into AddressOfFunctions } sorted by
+ *                rva, one entry per address with its first name
+ *   name slots   { FNV-1a hash of name, index into AddressOfNames + 1 },
+ *                open addressing with linear probing, power of two slots
+ *                and at most half full, zero index for empty slots
+ *
+ * The index is used only when the dll has the same TimeDateStamp, CheckSum
+ * and SizeOfImage, every name slot holds the hash of a name of the dll and
+ * every entry names a function of the dll through its slot. Names missing
+ * from the index are still looked up by GetProcAddress( ).
+ */
+
+#include "pe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define EXPIDX_SUFFIX       ".expidx"
+#define EXPIDX_MAGIC        "EXPX"
+#define EXPIDX_VERSION      1
+#define EXPIDX_HEADER_SIZE  32
+#define EXPIDX_EXPORT_SIZE  12
+#define EXPIDX_SLOT_SIZE    8
+
+/* Build export index of the image into a buffer allocated by malloc( ).
+ * Returns zero when the image has no exports or memory cannot be allocated.
+ */
+int expidx_build(const pe_image *image, unsigned char **data, size_t *size);
+
+/* FNV-1a hash of a name as stored in the name slots */
+unsigned long expidx_hash_name(const char *name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* EXPIDX_H */
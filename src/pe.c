@@ -0,0 +1,247 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <string.h>
+#include "pe.h"
+
+/* See https://docs.microsoft.com/en-us/windows/win32/debug/pe-format for
+ * layout of the structures. Offsets below are relative to their start.
+ */
+
+static unsigned long read16( const unsigned char *p )
+{
+    return (unsigned long) p[0] | ( (unsigned long) p[1] << 8 );
+}
+
+static unsigned long read32( const unsigned char *p )
+{
+    return (unsigned long) p[0] | ( (unsigned long) p[1] << 8 ) | ( (unsigned long) p[2] << 16 ) | ( (unsigned long) p[3] << 24 );
+}
+
+int pe_image_init( pe_image *image, const void *data, size_t size, int mapped )
+{
+    const unsigned char *p = (const unsigned char *) data;
+    const unsigned char *opt;
+    unsigned long nt, opt_size, dir_offset;
+    unsigned long rva, dir_size;
+    size_t sections;
+
+    memset( image, 0, sizeof( *image ) );
+    image->data = p;
+    image->size = size;
+    image->mapped = mapped;
+
+    /* DOS header with the "MZ" signature and offset of the NT headers */
+    if( size < 0x40 || p[0] != 'M' || p[1] != 'Z' )
+        return 0;
+
+    nt = read32( p + 0x3c );
+    if( nt > size || size - nt < 24 || memcmp( p + nt, "PE\0\0", 4 ) != 0 )
+        return 0;
+
+    /* File header follows the signature */
+    image->section_count = (unsigned int) read16( p + nt + 6 );
+    image->timestamp = read32( p + nt + 8 );
+    opt_size = read16( p + nt + 20 );
+    opt = p + nt + 24;
+
+    if( size - nt - 24 < opt_size || opt_size < 2 )
+        return 0;
+
+    /* Data directories of PE32+ images are behind the 64-bit fields */
+    if( read16( opt ) == 0x10b )
+        dir_offset = 96;
+    else if( read16( opt ) == 0x20b )
+        dir_offset = 112;
+    else
+        return 0;
+
+    if( opt_size < dir_offset )
+        return 0;
+
+    image->size_of_image = read32( opt + 56 );
+    image->size_of_headers = read32( opt + 60 );
+    image->checksum = read32( opt + 64 );
+    image->directories = opt + dir_offset;
+    image->directory_count = read32( opt + dir_offset - 4 );
+    if( image->directory_count > ( opt_size - dir_offset ) / 8 )
+        image->directory_count = ( opt_size - dir_offset ) / 8;
+
+    sections = nt + 24 + opt_size;
+    if( ( size - sections ) / 40 < image->section_count )
+        return 0;
+    image->sections = p + sections;
+
+    if( pe_image_directory( image, PE_DIRECTORY_EXPORT, &rva, &dir_size ) && dir_size >= 40 )
+    {
+        image->exports = (const unsigned char *) pe_image_rva( image, rva, 40 );
+        image->exports_rva = rva;
+        image->exports_size = dir_size;
+    }
+
+    return 1;
+}
+
+const void *pe_image_rva( const pe_image *image, unsigned long rva, size_t size )
+{
+    const unsigned char *section;
+    unsigned long va, raw_size;
+    size_t offset;
+    unsigned int i;
+
+    if( image->mapped || rva < image->size_of_headers )
+    {
+        offset = rva;
+    }
+    else
+    {
+        /* Translate RVA to file offset through the section which contains it */
+        for( i = 0; i < image->section_count; i++ )
+        {
+            section = image->sections + i * 40;
+            va = read32( section + 12 );
+            raw_size = read32( section + 16 );
+            if( rva >= va && rva - va < raw_size )
+                break;
+        }
+
+        if( i == image->section_count || size > raw_size - ( rva - va ) )
+            return NULL;
+
+        offset = (size_t) read32( section + 20 ) + ( rva - va );
+    }
+
+    if( offset > image->size || image->size - offset < size )
+        return NULL;
+
+    return image->data + offset;
+}
+
+int pe_image_directory( const pe_image *image, int index, unsigned long *rva, unsigned long *size )
+{
+    const unsigned char *dir;
+
+    if( index < 0 || (unsigned long) index >= image->directory_count )
+        return 0;
+
+    dir = image->directories + index * 8;
+    *rva = read32( dir );
+    *size = read32( dir + 4 );
+
+    return *rva != 0 && *size != 0;
+}
+
+/* Get zero terminated string at rva */
+static const char *pe_image_string( const pe_image *image, unsigned long rva )
+{
+    const unsigned char *p;
+
+    p = (const unsigned char *) pe_image_rva( image, rva, 1 );
+    if( p == NULL || memchr( p, '\0', image->size - ( p - image->data ) ) == NULL )
+        return NULL;
+
+    return (const char *) p;
+}
+
+/* Get RVA of the function at index into the export address table */
+static int export_function( const pe_image *image, unsigned long index, unsigned long *rva )
+{
+    const unsigned char *p;
+
+    if( index >= read32( image->exports + 20 ) )
+        return 0;
+
+    p = (const unsigned char *) pe_image_rva( image, read32( image->exports + 28 ) + index * 4, 4 );
+    if( p == NULL )
+        return 0;
+
+    *rva = read32( p );
+
+    return *rva != 0;
+}
+
+unsigned long pe_export_name_count( const pe_image *image )
+{
+    return image->exports != NULL ? read32( image->exports + 24 ) : 0;
+}
+
+const char *pe_export_name( const pe_image *image, unsigned long index, unsigned long *rva )
+{
+    const unsigned char *name;
+    const unsigned char *ordinal;
+
+    if( index >= pe_export_name_count( image ) )
+        return NULL;
+
+    name = (const unsigned char *) pe_image_rva( image, read32( image->exports + 32 ) + index * 4, 4 );
+    ordinal = (const unsigned char *) pe_image_rva( image, read32( image->exports + 36 ) + index * 2, 2 );
+    if( name == NULL || ordinal == NULL )
+        return NULL;
+
+    if( rva != NULL && !export_function( image, read16( ordinal ), rva ) )
+        return NULL;
+
+    return pe_image_string( image, read32( name ) );
+}
+
+int pe_export_find( const pe_image *image, const char *name, unsigned long *rva )
+{
+    unsigned long lo, hi, mid;
+    const char *entry;
+    int cmp;
+
+    /* Names in the export directory are sorted, which is also what the
+     * Windows loader relies on */
+    lo = 0;
+    hi = pe_export_name_count( image );
+    while( lo < hi )
+    {
+        mid = lo + ( hi - lo ) / 2;
+        entry = pe_export_name( image, mid, NULL );
+        if( entry == NULL )
+            return 0;
+
+        cmp = strcmp( name, entry );
+        if( cmp == 0 )
+            return pe_export_name( image, mid, rva ) != NULL;
+        if( cmp < 0 )
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return 0;
+}
+
+int pe_export_find_ordinal( const pe_image *image, unsigned long ordinal, unsigned long *rva )
+{
+    unsigned long base;
+
+    if( image->exports == NULL )
+        return 0;
+
+    base = read32( image->exports + 16 );
+    if( ordinal < base )
+        return 0;
+
+    return export_function( image, ordinal - base, rva );
+}
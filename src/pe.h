@@ -0,0 +1,92 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PE_H
+#define PE_H
+
+/* Parser of PE images which are not loaded by the Windows loader, e.g. dll
+ * files mapped from disk. It does not depend on windows.h, so it can also be
+ * used on other systems. All values are read as little endian and every
+ * offset is checked against the size of the image, so damaged files are
+ * rejected instead of crashing.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PE_DIRECTORY_EXPORT       0
+#define PE_DIRECTORY_IMPORT       1
+#define PE_DIRECTORY_DELAY_IMPORT 13
+
+typedef struct pe_image
+{
+    const unsigned char *data;
+    size_t size;
+    int mapped;                         /* Sections are at their RVAs, as in a loaded module */
+    unsigned long timestamp;            /* TimeDateStamp of the file header */
+    unsigned long checksum;             /* CheckSum of the optional header */
+    unsigned long size_of_image;
+    unsigned long size_of_headers;
+    const unsigned char *directories;   /* Data directory array of the optional header */
+    unsigned long directory_count;
+    const unsigned char *sections;      /* Section table */
+    unsigned int section_count;
+    const unsigned char *exports;       /* Export directory or NULL */
+    unsigned long exports_rva;
+    unsigned long exports_size;
+} pe_image;
+
+/* Parse headers of the image of size bytes at data. With mapped nonzero the
+ * image is laid out as by the loader, otherwise as in the file. Returns
+ * nonzero on success.
+ */
+int pe_image_init(pe_image *image, const void *data, size_t size, int mapped);
+
+/* Get pointer to size bytes at rva, NULL when they are not in the image */
+const void *pe_image_rva(const pe_image *image, unsigned long rva, size_t size);
+
+/* Get RVA and size of a data directory, returns zero if it is not present */
+int pe_image_directory(const pe_image *image, int index, unsigned long *rva, unsigned long *size);
+
+/* Number of exported names */
+unsigned long pe_export_name_count(const pe_image *image);
+
+/* Get index-th exported name in lexical order and the RVA of its function,
+ * NULL if the entry is invalid.
+ */
+const char *pe_export_name(const pe_image *image, unsigned long index, unsigned long *rva);
+
+/* Find RVA of an exported function by name or by ordinal, returns zero if it
+ * is not exported. RVAs inside the export directory belong to forwarded
+ * exports and point to the "dll.function" forwarder string.
+ */
+int pe_export_find(const pe_image *image, const char *name, unsigned long *rva);
+int pe_export_find_ordinal(const pe_image *image, unsigned long ordinal, unsigned long *rva);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* PE_H */
@@ -104,6 +104,78 @@ static int check_dladdr_by_dlopen( const char *hint, char *libname, char *sym, i
 }
 #endif
 
+#ifdef _WIN32
+/**
+ * @brief check that dli_fname stays valid and dladdr_r copies the names
+ * @param addr1 address in one module
+ * @param addr2 address in another module
+ * @return 0 check passed
+ * @return 1 check failed
+ */
+static int check_dladdr_r( void *addr1, void *addr2 )
+{
+    Dl_info info1, info2, info_r;
+    char fname[1024];
+    char sname[256];
+    char small[2];
+    int passed;
+
+    if( !dladdr( addr1, &info1 ) || !dladdr( addr2, &info2 ) )
+    {
+        printf( "checking dladdr_r -> failed (could not get symbol information)\n" );
+        return 1;
+    }
+
+    /* Filename of the first module is not overwritten by the second call */
+    passed = info1.dli_fname != info2.dli_fname && strcmp( info1.dli_fname, info2.dli_fname ) != 0;
+
+    passed = passed && dladdr_r( addr1, &info_r, fname, sizeof( fname ), sname, sizeof( sname ) );
+    passed = passed && info_r.dli_fname == fname && strcmp( fname, info1.dli_fname ) == 0;
+    passed = passed && ( info1.dli_sname == NULL ? info_r.dli_sname == NULL : info_r.dli_sname == sname && strcmp( sname, info1.dli_sname ) == 0 );
+    passed = passed && info_r.dli_fbase == info1.dli_fbase && info_r.dli_saddr == info1.dli_saddr;
+
+    /* Too small buffer */
+    passed = passed && !dladdr_r( addr1, &info_r, small, sizeof( small ), sname, sizeof( sname ) );
+
+    printf( "checking dladdr_r -> %s\n", passed ? "passed" : "failed" );
+    return !passed;
+}
+#endif
+
+#ifdef _WIN32
+/**
+ * @brief check that dladdr_batch returns the same information as dladdr
+ * @param addrs addresses to check
+ * @param count number of addresses
+ * @return 0 check passed
+ * @return 1 check failed
+ */
+static int check_dladdr_batch( const void **addrs, int count )
+{
+    Dl_info infos[16];
+    Dl_info info;
+    int i, result, found;
+    int passed = 1;
+
+    found = dladdr_batch( addrs, infos, count );
+    for( i = 0; i < count; i++ )
+    {
+        result = dladdr( addrs[i], &info );
+        if( !result )
+            passed = passed && infos[i].dli_fname == NULL;
+        else
+            passed = passed && infos[i].dli_fname && strcmp( infos[i].dli_fname, info.dli_fname ) == 0
+                     && infos[i].dli_fbase == info.dli_fbase && infos[i].dli_saddr == info.dli_saddr
+                     && ( info.dli_sname ? infos[i].dli_sname && strcmp( infos[i].dli_sname, info.dli_sname ) == 0 : !infos[i].dli_sname );
+        found -= result;
+    }
+    passed = passed && found == 0;
+
+    printf( "checking dladdr_batch -> %s\n", passed ? "passed" : "failed" );
+    return !passed;
+}
+#endif
+
 #ifdef _WIN32
 #include <windows.h>
 #if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6))
@@ -181,6 +253,13 @@ int main(int argc, char **argv)
 
     result |= check_dladdr ( "address by image allocation table", (void*)LoadLibraryExA, "LoadLibraryExA", Pass );
     result |= check_dladdr_by_dlopen( "address by dlsym", "kernel32.dll", "LoadLibraryExA", Pass );
+
+    result |= check_dladdr_r( (void*)main, (void*)atoi );
+
+    {
+        const void *addrs[] = { (void*)main, (void*)atoi, (void*)0x125, (void*)GetModuleHandleA, (void*)dladdr, ((char*)atoi)+1, (void*)print_dl_info, (void*)LoadLibraryExA };
+        result |= check_dladdr_batch( addrs, sizeof( addrs ) / sizeof( addrs[0] ) );
+    }
 #endif
     return result;
 }
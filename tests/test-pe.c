@@ -0,0 +1,451 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pe.h"
+#include "expidx.h"
+#ifdef _WIN32
+#include <windows.h>
+#include "dlfcn.h"
+#endif
+
+/* This test builds small PE32 and PE32+ images in memory, in the file layout
+ * and in the layout of a loaded module, and checks the export directory
+ * parser and the export index builder on them. It also runs on systems other
+ * than Windows. On Windows it also checks dlsym_peek( ) and dlsym_scan( ) on
+ * the test dlls.
+ */
+
+#define IMAGE_SIZE   0x2000
+#define FILE_SIZE    0x400
+#define SECTION_RVA  0x1000
+#define SECTION_FILE 0x200
+#define FORWARDER    0x1070
+
+static int failed;
+
+static void check( int condition, const char *message )
+{
+    if( !condition )
+    {
+        printf( "ERROR\t%s\n", message );
+        failed = 1;
+    }
+}
+
+static void write16( unsigned char *p, unsigned long value )
+{
+    p[0] = (unsigned char) value;
+    p[1] = (unsigned char) ( value >> 8 );
+}
+
+static void write32( unsigned char *p, unsigned long value )
+{
+    write16( p, value & 0xffff );
+    write16( p + 2, value >> 16 );
+}
+
+/* Build image with one section which holds the export directory. Exports
+ * beta (ordinal 5), gamma (ordinal 6, forwarded) and alpha (ordinal 7).
+ */
+static void build_image( unsigned char *image, int pe32plus, int mapped )
+{
+    unsigned long opt_size = pe32plus ? 240 : 224;
+    unsigned char *opt = image + 0x58;
+    unsigned char *section = opt + opt_size;
+    unsigned char *exports = image + ( mapped ? SECTION_RVA : SECTION_FILE );
+
+    memset( image, 0, mapped ? IMAGE_SIZE : FILE_SIZE );
+
+    image[0] = 'M';
+    image[1] = 'Z';
+    write32( image + 0x3c, 0x40 );
+
+    memcpy( image + 0x40, "PE\0\0", 4 );
+    write16( image + 0x44, pe32plus ? 0x8664 : 0x14c );
+    write16( image + 0x46, 1 );
+    write32( image + 0x48, 0x12345678 );
+    write16( image + 0x54, opt_size );
+
+    write16( opt, pe32plus ? 0x20b : 0x10b );
+    write32( opt + 56, IMAGE_SIZE );
+    write32( opt + 60, SECTION_FILE );
+    write32( opt + 64, 0xabcdef );
+    write32( opt + ( pe32plus ? 108 : 92 ), 16 );
+    write32( opt + ( pe32plus ? 112 : 96 ), SECTION_RVA );
+    write32( opt + ( pe32plus ? 116 : 100 ), 0x100 );
+
+    memcpy( section, ".edata", 6 );
+    write32( section + 8, 0x100 );
+    write32( section + 12, SECTION_RVA );
+    write32( section + 16, 0x200 );
+    write32( section + 20, SECTION_FILE );
+
+    write32( exports + 16, 5 );
+    write32( exports + 20, 3 );
+    write32( exports + 24, 3 );
+    write32( exports + 28, SECTION_RVA + 0x28 );
+    write32( exports + 32, SECTION_RVA + 0x34 );
+    write32( exports + 36, SECTION_RVA + 0x40 );
+
+    write32( exports + 0x28, 0x3000 );
+    write32( exports + 0x2c, FORWARDER );
+    write32( exports + 0x30, 0x3020 );
+
+    write32( exports + 0x34, SECTION_RVA + 0x50 );
+    write32( exports + 0x38, SECTION_RVA + 0x58 );
+    write32( exports + 0x3c, SECTION_RVA + 0x60 );
+    write16( exports + 0x40, 2 );
+    write16( exports + 0x42, 0 );
+    write16( exports + 0x44, 1 );
+
+    strcpy( (char *) exports + 0x50, "alpha" );
+    strcpy( (char *) exports + 0x58, "beta" );
+    strcpy( (char *) exports + 0x60, "gamma" );
+    strcpy( (char *) exports + ( FORWARDER - SECTION_RVA ), "other.function" );
+}
+
+static void check_image( const unsigned char *data, size_t size, int mapped )
+{
+    pe_image image;
+    unsigned long rva;
+    const char *forwarder;
+
+    check( pe_image_init( &image, data, size, mapped ), "Could not parse image" );
+    check( image.timestamp == 0x12345678 && image.checksum == 0xabcdef, "Wrong timestamp or checksum" );
+    check( image.exports_rva == SECTION_RVA && image.exports_size == 0x100, "Wrong export directory" );
+
+    check( pe_export_find( &image, "alpha", &rva ) && rva == 0x3020, "alpha not found" );
+    check( pe_export_find( &image, "beta", &rva ) && rva == 0x3000, "beta not found" );
+    check( pe_export_find( &image, "gamma", &rva ) && rva == FORWARDER, "gamma not found" );
+    check( !pe_export_find( &image, "delta", &rva ), "delta found" );
+    check( !pe_export_find( &image, "", &rva ), "empty name found" );
+
+    forwarder = (const char *) pe_image_rva( &image, FORWARDER, sizeof( "other.function" ) );
+    check( forwarder != NULL && strcmp( forwarder, "other.function" ) == 0, "Wrong forwarder string" );
+
+    check( pe_export_find_ordinal( &image, 5, &rva ) && rva == 0x3000, "Ordinal 5 not found" );
+    check( pe_export_find_ordinal( &image, 7, &rva ) && rva == 0x3020, "Ordinal 7 not found" );
+    check( !pe_export_find_ordinal( &image, 4, &rva ), "Ordinal 4 found" );
+    check( !pe_export_find_ordinal( &image, 8, &rva ), "Ordinal 8 found" );
+
+    check( pe_export_name_count( &image ) == 3, "Wrong number of names" );
+    check( strcmp( pe_export_name( &image, 0, &rva ), "alpha" ) == 0 && rva == 0x3020, "Wrong first name" );
+    check( strcmp( pe_export_name( &image, 2, &rva ), "gamma" ) == 0 && rva == FORWARDER, "Wrong last name" );
+    check( pe_export_name( &image, 3, &rva ) == NULL, "Name after the last one" );
+}
+
+static unsigned long read32( const unsigned char *p )
+{
+    return (unsigned long) p[0] | ( (unsigned long) p[1] << 8 ) | ( (unsigned long) p[2] << 16 ) | ( (unsigned long) p[3] << 24 );
+}
+
+static unsigned long fnv1a( const char *name )
+{
+    unsigned long hash = 2166136261UL;
+
+    while( *name )
+        hash = ( ( hash ^ (unsigned char) *name++ ) * 16777619UL ) & 0xffffffffUL;
+
+    return hash;
+}
+
+/* Check export index, gamma is forwarded to a string below the functions */
+static void check_index( const unsigned char *data, size_t size, int mapped )
+{
+    static const char *names[] = { "alpha", "beta", "gamma" };
+    static const unsigned long rvas[] = { FORWARDER, 0x3000, 0x3020 };
+    static const unsigned long indexes[] = { 1, 0, 2 };
+    static const unsigned long name_rvas[] = { SECTION_RVA + 0x60, SECTION_RVA + 0x58, SECTION_RVA + 0x50 };
+    const unsigned char *exports, *slots;
+    unsigned char *index;
+    size_t index_size;
+    pe_image image;
+    unsigned long i, slot, used;
+
+    pe_image_init( &image, data, size, mapped );
+    if( !expidx_build( &image, &index, &index_size ) )
+    {
+        check( 0, "Could not build export index" );
+        return;
+    }
+
+    check( index_size == EXPIDX_HEADER_SIZE + 3 * EXPIDX_EXPORT_SIZE + 16 * EXPIDX_SLOT_SIZE, "Wrong size of export index" );
+    check( memcmp( index, EXPIDX_MAGIC, 4 ) == 0 && read32( index + 4 ) == EXPIDX_VERSION, "Wrong export index magic" );
+    check( read32( index + 8 ) == 0x12345678 && read32( index + 12 ) == 0xabcdef && read32( index + 16 ) == IMAGE_SIZE, "Wrong export index key" );
+    check( read32( index + 20 ) == 3 && read32( index + 24 ) == 16, "Wrong export index counts" );
+
+    exports = index + EXPIDX_HEADER_SIZE;
+    for( i = 0; i < 3; i++ )
+    {
+        check( read32( exports + i * EXPIDX_EXPORT_SIZE ) == rvas[i] &&
+               read32( exports + i * EXPIDX_EXPORT_SIZE + 4 ) == name_rvas[i] &&
+               read32( exports + i * EXPIDX_EXPORT_SIZE + 8 ) == indexes[i], "Wrong export index entry" );
+    }
+
+    slots = exports + 3 * EXPIDX_EXPORT_SIZE;
+    for( i = 0; i < 3; i++ )
+    {
+        for( slot = fnv1a( names[i] ) & 15; read32( slots + slot * 8 + 4 ) != 0 && read32( slots + slot * 8 + 4 ) != i + 1; slot = ( slot + 1 ) & 15 );
+        check( read32( slots + slot * 8 + 4 ) == i + 1 && read32( slots + slot * 8 ) == fnv1a( names[i] ), "Name not found in export index" );
+    }
+
+    used = 0;
+    for( slot = 0; slot < 16; slot++ )
+        if( read32( slots + slot * 8 + 4 ) != 0 )
+            used++;
+    check( used == 3, "Wrong number of used slots in export index" );
+
+    free( index );
+}
+
+/* Truncated and damaged images must be rejected without reading outside */
+static void check_damaged( unsigned char *data, size_t size, int mapped )
+{
+    unsigned char *copy;
+    pe_image image;
+    unsigned long rva;
+    size_t i;
+
+    for( i = 0; i <= size; i += 4 )
+    {
+        /* Copy to exactly sized buffer, so that tools like valgrind notice
+         * reads past the end */
+        copy = (unsigned char *) malloc( i ? i : 1 );
+        if( copy == NULL )
+            break;
+        memcpy( copy, data, i );
+        if( pe_image_init( &image, copy, i, mapped ) )
+        {
+            pe_export_find( &image, "alpha", &rva );
+            pe_export_find( &image, "gamma", &rva );
+            pe_export_find_ordinal( &image, 7, &rva );
+        }
+        free( copy );
+    }
+    check( i > size, "Could not allocate memory" );
+
+    data[1] = 'X';
+    check( !pe_image_init( &image, data, size, mapped ), "Image without MZ signature accepted" );
+    data[1] = 'Z';
+
+    write32( data + 0x3c, (unsigned long) size );
+    check( !pe_image_init( &image, data, size, mapped ), "Image with NT headers outside accepted" );
+    write32( data + 0x3c, 0x40 );
+
+    write16( data + 0x58, 0x107 );
+    check( !pe_image_init( &image, data, size, mapped ), "Image with wrong optional header magic accepted" );
+}
+
+#ifdef _WIN32
+static int ends_with( const char *string, const char *suffix )
+{
+    size_t len = strlen( string );
+    size_t suffix_len = strlen( suffix );
+
+    return len >= suffix_len && strcmp( string + len - suffix_len, suffix ) == 0;
+}
+
+/* Write export index for testdll.dll, optionally with a wrong timestamp */
+static int write_testdll_index( int damaged )
+{
+    static unsigned char data[1 << 20];
+    unsigned char *index;
+    size_t size, index_size;
+    pe_image image;
+    FILE *file;
+    int ret;
+
+    file = fopen( "testdll.dll", "rb" );
+    if( file == NULL )
+        return 0;
+    size = fread( data, 1, sizeof( data ), file );
+    fclose( file );
+
+    if( !pe_image_init( &image, data, size, 0 ) || !expidx_build( &image, &index, &index_size ) )
+        return 0;
+
+    if( damaged )
+        index[8] ^= 1;
+
+    file = fopen( "testdll.dll" EXPIDX_SUFFIX, "wb" );
+    ret = file != NULL && fwrite( index, 1, index_size, file ) == index_size;
+    if( file != NULL )
+        fclose( file );
+
+    free( index );
+
+    return ret;
+}
+
+/* dlsym( ) and dladdr( ) must give the same results with an export index as
+ * without it, and an index which does not match must be ignored */
+static void check_dlopen_index( void )
+{
+    dlfcn_win32_stats before, after;
+    FARPROC expected;
+    void *library, *symbol;
+    Dl_info info;
+    int damaged;
+
+    for( damaged = 0; damaged <= 1; damaged++ )
+    {
+        if( !write_testdll_index( damaged ) )
+        {
+            printf( "ERROR\tCould not write export index of testdll.dll\n" );
+            failed = 1;
+            return;
+        }
+
+        dlfcn_win32_get_stats( &before );
+        library = dlopen( "testdll.dll", RTLD_LOCAL );
+        dlfcn_win32_get_stats( &after );
+        if( library == NULL )
+        {
+            printf( "ERROR\tCould not open testdll.dll: %s\n", dlerror( ) );
+            failed = 1;
+            break;
+        }
+
+        if( after.export_indexes_mapped - before.export_indexes_mapped != ( damaged ? 0 : 1 ) )
+        {
+            printf( "ERROR\t%s export index was %s\n", damaged ? "Damaged" : "Valid", damaged ? "used" : "not used" );
+            failed = 1;
+        }
+
+        expected = GetProcAddress( (HMODULE) library, "function" );
+        symbol = dlsym( library, "function" );
+        if( symbol == NULL || symbol != *(void **) &expected || dlsym( library, "nonexistent_function" ) != NULL )
+        {
+            printf( "ERROR\tdlsym( ) returned wrong address with %s export index\n", damaged ? "damaged" : "valid" );
+            failed = 1;
+        }
+        else if( !dladdr( symbol, &info ) || info.dli_saddr != symbol || info.dli_sname == NULL || strcmp( info.dli_sname, "function" ) != 0 )
+        {
+            printf( "ERROR\tdladdr( ) returned wrong symbol with %s export index\n", damaged ? "damaged" : "valid" );
+            failed = 1;
+        }
+        else
+            printf( "SUCCESS\tdlsym( ) and dladdr( ) work with %s export index\n", damaged ? "damaged" : "valid" );
+
+        dlclose( library );
+    }
+
+    remove( "testdll.dll" EXPIDX_SUFFIX );
+}
+
+/* testdll.dll exports function and function2, testdll2.dll only function2 */
+static void check_scan( void )
+{
+    static const char *names[] = { "function2", "function" };
+    dlsym_scan_result *results;
+    int ret, ok, i;
+
+    ret = dlsym_scan( ".", names, 1, 2, &results );
+    ok = ret == 2;
+    for( i = 0; ok && i < ret; i++ )
+    {
+        if( !ends_with( results[i].fname, "\\testdll.dll" ) && !ends_with( results[i].fname, "\\testdll2.dll" ) )
+            ok = 0;
+    }
+    dlsym_scan_free( results, ret );
+    if( !ok )
+    {
+        printf( "ERROR\tdlsym_scan( ) did not find function2 in testdll.dll and testdll2.dll\n" );
+        failed = 1;
+        return;
+    }
+
+    ret = dlsym_scan( ".", names, 2, 0, &results );
+    if( ret != 1 || !ends_with( results[0].fname, "\\testdll.dll" ) || results[0].rvas[0] == 0 || results[0].rvas[1] == 0 )
+    {
+        printf( "ERROR\tdlsym_scan( ) did not find function2 and function in testdll.dll\n" );
+        failed = 1;
+    }
+    else
+        printf( "SUCCESS\tdlsym_scan( ) found testdll.dll\n" );
+    dlsym_scan_free( results, ret );
+
+    if( dlsym_scan( "nonexistent_directory", names, 2, 0, &results ) != -1 || results != NULL )
+    {
+        printf( "ERROR\tdlsym_scan( ) did not fail for nonexistent directory\n" );
+        failed = 1;
+    }
+}
+#endif
+
+int main( void )
+{
+    static unsigned char data[IMAGE_SIZE];
+    int pe32plus;
+
+    for( pe32plus = 0; pe32plus <= 1; pe32plus++ )
+    {
+        build_image( data, pe32plus, 0 );
+        check_image( data, FILE_SIZE, 0 );
+        check_index( data, FILE_SIZE, 0 );
+        check_damaged( data, FILE_SIZE, 0 );
+
+        build_image( data, pe32plus, 1 );
+        check_image( data, IMAGE_SIZE, 1 );
+        check_index( data, IMAGE_SIZE, 1 );
+        check_damaged( data, IMAGE_SIZE, 1 );
+    }
+
+    if( !failed )
+        printf( "SUCCESS\tParsed PE images\n" );
+
+#ifdef _WIN32
+    {
+        static const char *names[] = { "function", "nonexistent_function" };
+        int found[2];
+
+        if( dlsym_peek( "testdll.dll", names, found, 2 ) != 1 || !found[0] || found[1] )
+        {
+            printf( "ERROR\tdlsym_peek( ) did not find exports of testdll.dll: %s\n", dlerror( ) );
+            failed = 1;
+        }
+        else if( GetModuleHandleA( "testdll.dll" ) != NULL )
+        {
+            printf( "ERROR\tdlsym_peek( ) loaded testdll.dll\n" );
+            failed = 1;
+        }
+        else
+            printf( "SUCCESS\tdlsym_peek( ) found exports of testdll.dll\n" );
+
+        if( dlsym_peek( "nonexistent.dll", names, found, 2 ) != -1 || dlerror( ) == NULL )
+        {
+            printf( "ERROR\tdlsym_peek( ) did not fail for nonexistent file\n" );
+            failed = 1;
+        }
+        else
+            printf( "SUCCESS\tdlsym_peek( ) failed for nonexistent file\n" );
+
+        check_scan( );
+        check_dlopen_index( );
+    }
+#endif
+
+    return failed;
+}
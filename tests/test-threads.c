@@ -0,0 +1,185 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifdef _DEBUG
+#define _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <windows.h>
+#include "dlfcn.h"
+
+/* This test runs dlopen( ), dlsym( ), dladdr( ) and dlclose( ) from several
+ * threads at the same time. Half of the threads keep opening and closing
+ * libraries, the other half keep looking up symbols in the global scope and
+ * through a handle which stays open during the whole test.
+ */
+
+#define THREADS    8
+#define ITERATIONS 2000
+
+static void *library;
+static FARPROC expected;
+static volatile LONG failures;
+
+static void fail( const char *message )
+{
+    printf( "ERROR\t%s\n", message );
+    InterlockedIncrement( &failures );
+}
+
+static DWORD WINAPI open_close_thread( LPVOID param )
+{
+    void *handle;
+    void *symbol;
+    int i;
+
+    for( i = 0; i < ITERATIONS && failures == 0; i++ )
+    {
+        handle = dlopen( ( (ULONG_PTR) param & 1 ) ? "testdll3.dll" : "testdll2.dll", ( i & 1 ) ? RTLD_GLOBAL : RTLD_LOCAL );
+        if( !handle )
+        {
+            fail( "Could not open library" );
+            break;
+        }
+
+        symbol = dlsym( handle, ( (ULONG_PTR) param & 1 ) ? "function3" : "function2" );
+        if( !symbol )
+            fail( "Could not get symbol from opened library" );
+
+        if( dlclose( handle ) )
+            fail( "Could not close library" );
+    }
+
+    return 0;
+}
+
+static DWORD WINAPI lookup_thread( LPVOID param )
+{
+    void *symbol;
+    Dl_info info;
+    char *error;
+    int i;
+
+    (void) param;
+
+    for( i = 0; i < ITERATIONS && failures == 0; i++ )
+    {
+        symbol = dlsym( library, "function" );
+        if( symbol != *(void **) &expected )
+            fail( "dlsym( library, \"function\" ) returned wrong address" );
+
+        /* testdll.dll was opened with RTLD_GLOBAL */
+        symbol = dlsym( RTLD_DEFAULT, "function" );
+        if( symbol != *(void **) &expected )
+            fail( "dlsym( RTLD_DEFAULT, \"function\" ) returned wrong address" );
+
+        if( dlsym( RTLD_DEFAULT, "nonexistent_symbol" ) != NULL )
+            fail( "dlsym( RTLD_DEFAULT, \"nonexistent_symbol\" ) succeeded" );
+
+        /* Error state is per thread, so other threads cannot clobber it */
+        error = dlerror( );
+        if( !error || !strstr( error, "nonexistent_symbol" ) )
+            fail( "dlerror( ) did not report the failed lookup of this thread" );
+        if( dlerror( ) != NULL )
+            fail( "Second call to dlerror( ) did not return NULL" );
+
+        if( !dladdr( *(void **) &expected, &info ) || info.dli_saddr != *(void **) &expected )
+            fail( "dladdr( ) did not find function" );
+    }
+
+    return 0;
+}
+
+int main( void )
+{
+    HANDLE threads[THREADS];
+    dlfcn_win32_stats stats;
+    DWORD i;
+
+    dlfcn_win32_reset_stats( );
+
+    library = dlopen( "testdll.dll", RTLD_GLOBAL );
+    if( !library )
+    {
+        printf( "ERROR\tCould not open library: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    expected = GetProcAddress( (HMODULE) library, "function" );
+    if( !expected )
+    {
+        printf( "ERROR\tGetProcAddress( ) failed: %lu\n", (unsigned long) GetLastError( ) );
+        dlclose( library );
+        return 1;
+    }
+
+    for( i = 0; i < THREADS; i++ )
+    {
+        threads[i] = CreateThread( NULL, 0, ( i & 1 ) ? lookup_thread : open_close_thread, (LPVOID) (ULONG_PTR) ( i / 2 ), 0, NULL );
+        if( threads[i] == NULL )
+        {
+            printf( "ERROR\tCould not create thread: %lu\n", (unsigned long) GetLastError( ) );
+            return 1;
+        }
+    }
+
+    WaitForMultipleObjects( THREADS, threads, TRUE, INFINITE );
+
+    for( i = 0; i < THREADS; i++ )
+        CloseHandle( threads[i] );
+
+    if( dlclose( library ) )
+    {
+        printf( "ERROR\tCould not close library: %s\n", dlerror( ) );
+        return 1;
+    }
+
+    if( failures != 0 )
+        return 1;
+
+    /* Counters of finished threads must not be lost */
+    dlfcn_win32_get_stats( &stats );
+    if( stats.dlopen_calls != THREADS / 2 * ITERATIONS + 1 || stats.dlclose_calls != THREADS / 2 * ITERATIONS + 1 )
+    {
+        printf( "ERROR\tWrong number of dlopen( ) or dlclose( ) calls in statistics: %lu, %lu\n", (unsigned long) stats.dlopen_calls, (unsigned long) stats.dlclose_calls );
+        return 1;
+    }
+    if( stats.dlsym_calls != THREADS / 2 * ITERATIONS * 4 || stats.dlsym_misses != THREADS / 2 * ITERATIONS )
+    {
+        printf( "ERROR\tWrong number of dlsym( ) calls in statistics: %lu, %lu\n", (unsigned long) stats.dlsym_calls, (unsigned long) stats.dlsym_misses );
+        return 1;
+    }
+
+    dlfcn_win32_reset_stats( );
+    dlfcn_win32_get_stats( &stats );
+    if( stats.dlopen_calls != 0 || stats.dlsym_calls != 0 )
+    {
+        printf( "ERROR\tStatistics were not reset\n" );
+        return 1;
+    }
+
+    printf( "SUCCESS\tAll threads finished\n" );
+    return 0;
+}
@@ -79,17 +79,33 @@
  * If one test fails, the program terminates itself.
  */
 
+/* Events recorded by the trace callback */
+static dlfcn_win32_trace_event trace_events[4];
+static int trace_count;
+
+static void trace_callback( const dlfcn_win32_trace_event *event )
+{
+    if( trace_count < 4 )
+        trace_events[trace_count] = *event;
+    trace_count++;
+}
+
 int main()
 {
     void *global;
     void *library2;
     void *library;
+    void *library4;
+    dlfcn_win32_stats stats_before, stats_after;
     char *error;
     int (*function)( void );
     int (*function2_from_library2)( void );
     size_t (*fwrite_local) ( const void *, size_t, size_t, FILE * );
     size_t (*fputs_default) ( const char *, FILE * );
     int (*nonexistentfunction)( void );
+    void *(*function4_import)( void );
+    FARPROC function2_address;
+    HMODULE module2;
     int fd;
     int ret;
     HMODULE library3;
@@ -102,6 +118,9 @@ int main()
     HANDLE tempfile;
     DWORD dummy;
     UINT uMode;
+    size_t i;
+    void *symbols[4];
+    static const char *kernel32_symbols[] = { "GetModuleHandleA", "HeapAlloc", "LoadLibraryExA", "nonexistentfunction" };
 
 #ifdef _DEBUG
     _CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_FILE);
@@ -187,6 +206,41 @@ int main()
     else
         printf( "SUCCESS\tCould not open non-existent file nonexistentfile.dll: %s\n", error );
 
+    library = dlopen( "testdll3.dll", RTLD_NOLOAD );
+    if( library || GetModuleHandleA( "testdll3.dll" ) != NULL )
+    {
+        printf( "ERROR\tNot loaded library3 was opened with RTLD_NOLOAD\n" );
+        RETURN_ERROR;
+    }
+    error = dlerror( );
+    if( !error )
+    {
+        printf( "ERROR\tNo error from dlopen with RTLD_NOLOAD for not loaded library3\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tDid not load library3 with RTLD_NOLOAD: %s\n", error );
+
+    library = dlopen( "kernel32.dll", RTLD_NOLOAD );
+    if( !library || library != GetModuleHandleA( "kernel32.dll" ) )
+    {
+        error = dlerror( );
+        printf( "ERROR\tCould not open loaded kernel32.dll with RTLD_NOLOAD: %s\n", error ? error : "" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tOpened loaded kernel32.dll with RTLD_NOLOAD: %p\n", library );
+
+    ret = dlclose( library );
+    if( ret )
+    {
+        error = dlerror( );
+        printf( "ERROR\tCould not close kernel32.dll: %s\n", error ? error : "" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tClosed kernel32.dll.\n" );
+
     memset( toolongfile, 'X', sizeof( toolongfile ) - 5 );
     memcpy( toolongfile + sizeof( toolongfile ) - 5, ".dll", 5 );
 
@@ -328,6 +382,29 @@ int main()
     else
         printf( "SUCCESS\tOpened library globally: %p\n", library );
 
+    dlfcn_win32_get_stats( &stats_before );
+    library4 = dlopen( "testdll.dll", RTLD_LOCAL );
+    dlfcn_win32_get_stats( &stats_after );
+    if( library4 != library || stats_after.dlopen_cache_hits != stats_before.dlopen_cache_hits + 1 )
+    {
+        printf( "ERROR\tOpening library again did not use the path cache: %p\n", library4 );
+        CLOSE_LIB;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tOpened library again from the path cache.\n" );
+
+    ret = dlclose( library4 );
+    if( ret )
+    {
+        error = dlerror( );
+        printf( "ERROR\tCould not close library opened again: %s\n", error ? error : "" );
+        CLOSE_LIB;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tClosed library opened again.\n" );
+
     global = dlopen( 0, RTLD_GLOBAL );
     if( !global )
     {
@@ -634,6 +711,27 @@ int main()
         printf( "SUCCESS\tGot symbol from global handle: %p\n", *(void **) (&function) );
     
 
+    /* Lookup result of symbol from not yet loaded library must not be reused
+     * after the library is loaded */
+    *(void **) (&function) = dlsym( global, "function3" );
+    if( function )
+    {
+        printf( "ERROR\tGot symbol from not loaded library3 from global handle: %p\n", *(void **) (&function) );
+        CLOSE_LIB;
+        CLOSE_GLOBAL;
+        RETURN_ERROR;
+    }
+    error = dlerror( );
+    if( !error )
+    {
+        printf( "ERROR\tNo error from dlsym for symbol from not loaded library3\n" );
+        CLOSE_LIB;
+        CLOSE_GLOBAL;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tDid not get symbol from not loaded library3 from global handle: %s\n", error );
+
     uMode = SetErrorMode( SEM_FAILCRITICALERRORS );
     library3 = LoadLibraryA("testdll3.dll");
     SetErrorMode( uMode );
@@ -671,6 +769,89 @@ int main()
 
     RUNFUNC;
 
+    library = dlopen( "kernel32.dll", RTLD_GLOBAL );
+    if( !library )
+    {
+        error = dlerror( );
+        printf( "ERROR\tCould not open kernel32.dll: %s\n", error ? error : "" );
+        CLOSE_GLOBAL;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tOpened kernel32.dll: %p\n", library );
+
+    /* HeapAlloc is usually a forwarded export */
+    for( i = 0; i < sizeof( kernel32_symbols ) / sizeof( kernel32_symbols[0] ); i++ )
+    {
+        if( dlsym( library, kernel32_symbols[i] ) != (void *) GetProcAddress( (HMODULE) library, kernel32_symbols[i] ) )
+        {
+            printf( "ERROR\tdlsym and GetProcAddress returned different addresses for %s\n", kernel32_symbols[i] );
+            CLOSE_LIB;
+            CLOSE_GLOBAL;
+            RETURN_ERROR;
+        }
+    }
+    printf( "SUCCESS\tdlsym and GetProcAddress returned same addresses from kernel32.dll\n" );
+
+    /* Only nonexistentfunction is missing */
+    ret = dlsym_many( library, kernel32_symbols, symbols, sizeof( kernel32_symbols ) / sizeof( kernel32_symbols[0] ) );
+    error = dlerror( );
+    if( ret != 1 || !error )
+    {
+        printf( "ERROR\tdlsym_many returned %d missing symbols from kernel32.dll: %s\n", ret, error ? error : "" );
+        CLOSE_LIB;
+        CLOSE_GLOBAL;
+        RETURN_ERROR;
+    }
+    for( i = 0; i < sizeof( kernel32_symbols ) / sizeof( kernel32_symbols[0] ); i++ )
+    {
+        if( symbols[i] != (void *) GetProcAddress( (HMODULE) library, kernel32_symbols[i] ) )
+        {
+            printf( "ERROR\tdlsym_many and GetProcAddress returned different addresses for %s\n", kernel32_symbols[i] );
+            CLOSE_LIB;
+            CLOSE_GLOBAL;
+            RETURN_ERROR;
+        }
+    }
+    printf( "SUCCESS\tdlsym_many and GetProcAddress returned same addresses from kernel32.dll: %s\n", error );
+
+    ret = dlsym_many( global, kernel32_symbols, symbols, sizeof( kernel32_symbols ) / sizeof( kernel32_symbols[0] ) );
+    for( i = 0; i < sizeof( kernel32_symbols ) / sizeof( kernel32_symbols[0] ); i++ )
+    {
+        if( ret != 1 || symbols[i] != dlsym( global, kernel32_symbols[i] ) )
+        {
+            printf( "ERROR\tdlsym_many and dlsym returned different addresses for %s from global handle\n", kernel32_symbols[i] );
+            CLOSE_LIB;
+            CLOSE_GLOBAL;
+            RETURN_ERROR;
+        }
+    }
+    printf( "SUCCESS\tdlsym_many and dlsym returned same addresses from global handle\n" );
+
+    dlfcn_win32_set_trace_callback( trace_callback );
+    /* library is kernel32.dll here */
+    *(void **) (&function) = dlsym( library, "GetModuleHandleA" );
+    *(void **) (&nonexistentfunction) = dlsym( library, "nonexistentfunction" );
+    dlsym( library, (const char *) 1 );
+    dlfcn_win32_set_trace_callback( NULL );
+    dlsym( library, "GetModuleHandleA" );
+    if( trace_count != 3 ||
+        trace_events[0].function != DLFCN_WIN32_TRACE_DLSYM || !trace_events[0].success ||
+        trace_events[0].handle != library || strcmp( trace_events[0].name, "GetModuleHandleA" ) != 0 ||
+        trace_events[0].ordinal != 0 || trace_events[2].name != NULL || trace_events[2].ordinal != 1 ||
+        trace_events[0].addr != *(void **) &function || trace_events[0].thread_id != GetCurrentThreadId( ) ||
+        trace_events[0].end_ns < trace_events[0].start_ns || trace_events[1].start_ns < trace_events[0].end_ns ||
+        trace_events[1].success || trace_events[1].addr != NULL || nonexistentfunction != NULL )
+    {
+        printf( "ERROR\tTrace callback did not report the dlsym calls correctly\n" );
+        CLOSE_LIB;
+        CLOSE_GLOBAL;
+        RETURN_ERROR;
+    }
+    printf( "SUCCESS\tTrace callback reported the dlsym calls\n" );
+
+    CLOSE_LIB;
+
     ret = dlclose( global );
     if( ret )
     {
@@ -681,6 +862,111 @@ int main()
     else
         printf( "SUCCESS\tClosed global handle.\n" );
 
+    library = dlopen( "nonexistentfile.dll", RTLD_DEFER_LOAD | RTLD_LOCAL );
+    error = dlerror( );
+    if( library || !error || !strstr( error, "nonexistentfile.dll" ) )
+    {
+        printf( "ERROR\tDeferred dlopen of non-existent file did not fail\n" );
+        CLOSE_LIB;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tDeferred dlopen of non-existent file failed: %s\n", error );
+
+    library = dlopen( "testdll.dll", RTLD_DEFER_LOAD | RTLD_LOCAL );
+    if( !library || GetModuleHandleA( "testdll.dll" ) != NULL )
+    {
+        printf( "ERROR\tDeferred dlopen loaded library\n" );
+        RETURN_ERROR;
+    }
+    *(void **) (&function) = dlsym( library, "function" );
+    if( !function || GetModuleHandleA( "testdll.dll" ) == NULL || dlclose( library ) )
+    {
+        error = dlerror( );
+        printf( "ERROR\tCould not get symbol from library loaded by dlsym: %s\n", error ? error : "" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tLoaded library by dlsym.\n" );
+
+    library = dlopen( "testdll.dll", RTLD_DEFER_LOAD | RTLD_GLOBAL );
+    if( !library || (HMODULE) library != GetModuleHandleA( "testdll.dll" ) || dlclose( library ) )
+    {
+        printf( "ERROR\tDeferred dlopen with RTLD_GLOBAL did not load library\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tDeferred dlopen with RTLD_GLOBAL loaded library.\n" );
+
+    ret = dlfcn_win32_set_close_mode( DLFCN_WIN32_CLOSE_DEFERRED );
+    library2 = dlopen( "testdll2.dll", RTLD_LOCAL );
+    if( ret != DLFCN_WIN32_CLOSE_NOW || !library2 || dlclose( library2 ) || GetModuleHandleA( "testdll2.dll" ) == NULL )
+    {
+        printf( "ERROR\tDeferred dlclose did not keep library2 loaded\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tDeferred dlclose kept library2 loaded.\n" );
+
+    /* Opened again before unloading it must still be local */
+    library2 = dlopen( "testdll2.dll", RTLD_LOCAL );
+    if( !library2 || dlsym( RTLD_DEFAULT, "function2" ) != NULL || dlfcn_win32_flush_closes( ) != 0 )
+    {
+        printf( "ERROR\tLibrary2 opened again after deferred dlclose is not local\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tLibrary2 opened again after deferred dlclose is local.\n" );
+
+    if( dlclose( library2 ) || dlfcn_win32_flush_closes( ) != 1 || GetModuleHandleA( "testdll2.dll" ) != NULL )
+    {
+        printf( "ERROR\tFlushing deferred dlclose did not unload library2\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tFlushing deferred dlclose unloaded library2.\n" );
+
+    ret = dlfcn_win32_set_close_mode( DLFCN_WIN32_CLOSE_NOW );
+    if( ret != DLFCN_WIN32_CLOSE_DEFERRED )
+    {
+        printf( "ERROR\tCould not switch back to unloading at once\n" );
+        RETURN_ERROR;
+    }
+
+    /* testdll4.dll imports function2 of testdll2.dll delay-loaded, so only
+     * binding the import loads testdll2.dll before function2 is called */
+    if( GetModuleHandleA( "testdll2.dll" ) != NULL )
+    {
+        printf( "ERROR\tLibrary2 is loaded before opening library4\n" );
+        RETURN_ERROR;
+    }
+    library = dlopen( "testdll4.dll", RTLD_NOW | RTLD_LOCAL | RTLD_BIND_DELAY_IMPORTS );
+    module2 = GetModuleHandleA( "testdll2.dll" );
+    *(void **) ( &function4_import ) = library ? dlsym( library, "function4_import" ) : NULL;
+    function2_address = module2 ? GetProcAddress( module2, "function2" ) : NULL;
+    if( !library || !module2 || !function4_import || !function2_address || function4_import( ) != *(void **) ( &function2_address ) )
+    {
+        error = dlerror( );
+        printf( "ERROR\tRTLD_BIND_DELAY_IMPORTS did not bind delay-loaded import of library4: %s\n", error ? error : "" );
+        CLOSE_LIB;
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tRTLD_BIND_DELAY_IMPORTS bound delay-loaded import of library4.\n" );
+    CLOSE_LIB;
+
+    /* Drop the reference added by binding the import */
+    FreeLibrary( module2 );
+
+    library2 = dlopen( "testdll2.dll", RTLD_LOCAL | RTLD_NODELETE );
+    if( !library2 || dlclose( library2 ) || GetModuleHandleA( "testdll2.dll" ) == NULL )
+    {
+        printf( "ERROR\tLibrary2 opened with RTLD_NODELETE was unloaded\n" );
+        RETURN_ERROR;
+    }
+    else
+        printf( "SUCCESS\tLibrary2 opened with RTLD_NODELETE stayed loaded.\n" );
+
 #ifdef _DEBUG
     _CrtDumpMemoryLeaks();
 #endif
@@ -0,0 +1,136 @@
+/*
+ * dlfcn-win32
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#define _CRT_SECURE_NO_WARNINGS
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pe.h"
+#include "expidx.h"
+
+/* Write export index <file>.expidx for each dll file given on the command
+ * line, see expidx.h. It does not use any Windows API, so the indexes can be
+ * built as part of a build on other systems too.
+ */
+
+static unsigned char *read_file( const char *path, size_t *size )
+{
+    unsigned char *data;
+    FILE *file;
+    long length;
+
+    file = fopen( path, "rb" );
+    if( file == NULL )
+        return NULL;
+
+    data = NULL;
+    if( fseek( file, 0, SEEK_END ) == 0 && ( length = ftell( file ) ) > 0 && fseek( file, 0, SEEK_SET ) == 0 )
+    {
+        data = (unsigned char *) malloc( (size_t) length );
+        if( data != NULL && fread( data, 1, (size_t) length, file ) != (size_t) length )
+        {
+            free( data );
+            data = NULL;
+        }
+        *size = (size_t) length;
+    }
+
+    fclose( file );
+
+    return data;
+}
+
+static int write_index( const char *path )
+{
+    unsigned char *data, *index;
+    size_t size, index_size;
+    char *index_path;
+    pe_image image;
+    FILE *file;
+    int ret;
+
+    data = read_file( path, &size );
+    if( data == NULL )
+    {
+        fprintf( stderr, "mkexpidx: cannot read %s\n", path );
+        return 1;
+    }
+
+    if( !pe_image_init( &image, data, size, 0 ) )
+    {
+        fprintf( stderr, "mkexpidx: %s is not a PE file\n", path );
+        free( data );
+        return 1;
+    }
+
+    if( !expidx_build( &image, &index, &index_size ) )
+    {
+        fprintf( stderr, "mkexpidx: %s has no exported names\n", path );
+        free( data );
+        return 1;
+    }
+
+    free( data );
+
+    index_path = (char *) malloc( strlen( path ) + sizeof( EXPIDX_SUFFIX ) );
+    if( index_path == NULL )
+    {
+        free( index );
+        return 1;
+    }
+    strcpy( index_path, path );
+    strcat( index_path, EXPIDX_SUFFIX );
+
+    ret = 0;
+    file = fopen( index_path, "wb" );
+    if( file == NULL || fwrite( index, 1, index_size, file ) != index_size )
+        ret = 1;
+    if( file != NULL && fclose( file ) != 0 )
+        ret = 1;
+    if( ret )
+    {
+        fprintf( stderr, "mkexpidx: cannot write %s\n", index_path );
+        remove( index_path );
+    }
+
+    free( index_path );
+    free( index );
+
+    return ret;
+}
+
+int main( int argc, char **argv )
+{
+    int i, ret;
+
+    if( argc < 2 )
+    {
+        fprintf( stderr, "Usage: %s file.dll...\n", argv[0] );
+        return 1;
+    }
+
+    ret = 0;
+    for( i = 1; i < argc; i++ )
+        ret |= write_index( argv[i] );
+
+    return ret;
+}